@@ -0,0 +1,35 @@
+#pragma once
+
+#include "virtio.h"
+
+#define BCACHE_BLOCK_SIZE PAGE_SIZE                          // A cache block is a page of the disk
+#define BCACHE_BLOCK_SECTORS (BCACHE_BLOCK_SIZE / SECTOR_SIZE)
+#define BCACHE_BLOCKS 256                                    // Cached blocks (1MB)
+#define BCACHE_HASH_SIZE 512                                 // Hash buckets (a power of two)
+#define BCACHE_READAHEAD 8                                   // Blocks read at once after a sequential miss
+
+// A cached block. valid and dirty have a bit per sector, so that a block can be partly read (at the end of the disk) and
+// only the modified sectors are written back.
+struct bcache_buf {
+    struct virtio_blk* blk;         // Device, or NULL if the buffer is unused
+    unsigned block;                 // Block number on the device
+    uint8_t* data;                  // BCACHE_BLOCK_SIZE bytes
+    uint8_t valid;                  // Sectors read from (or written to) the device
+    uint8_t dirty;                  // Sectors modified since they were last written back
+    bool referenced;                // Used since the clock hand last passed (CLOCK eviction)
+    struct bcache_buf* hash_next;   // Next buffer in the same hash bucket
+};
+
+struct bcache_stats {
+    unsigned hits;        // Block lookups served from the cache
+    unsigned misses;      // Block lookups that had to read the device
+    unsigned readahead;   // Blocks read ahead of a sequential miss
+    unsigned writebacks;  // Write requests, on eviction or flush
+};
+
+extern struct bcache_stats bcache_stats;
+
+void bcache_init(void);
+int bcache_read(struct virtio_blk* blk, unsigned offset, void* buf, size_t len);
+int bcache_write(struct virtio_blk* blk, unsigned offset, const void* buf, size_t len);
+int bcache_flush(struct virtio_blk* blk);
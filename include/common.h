@@ -18,6 +18,8 @@ typedef uint32_t vaddr_t;
 #define NULL ((void*)0)
 // Round up to the nearest multiple of n (n must be a power of 2)
 #define align_up(value, align) __builtin_align_up(value, align)
+// Round down to the nearest multiple of n (n must be a power of 2)
+#define align_down(value, align) __builtin_align_down(value, align)
 // Determine if the given value is aligned to the given alignment (n must be a power of 2)
 #define is_aligned(value, align) __builtin_is_aligned(value, align)
 // Return the offset of the given member within a struct (how many bytes from the beginning of the structure)
@@ -43,11 +45,57 @@ typedef uint32_t vaddr_t;
 #define SYS_EXIT 3
 #define SYS_READFILE 4
 #define SYS_WRITEFILE 5
+#define SYS_SETPRIO 6
+#define SYS_WRITE 7
+#define SYS_HWCAP 8
+#define SYS_SYNC 9
+#define SYS_OPEN 10
+#define SYS_READ 11
+#define SYS_LSEEK 12
+#define SYS_CLOSE 13
+#define SYS_MMAP 14
+#define SYS_MUNMAP 15
+#define SYS_FORK 16
+
+// File descriptors 0 to 2 are the console
+#define STDIN_FILENO 0
+#define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+
+// SYS_OPEN flags
+#define O_RDONLY 0
+#define O_WRONLY 1
+#define O_RDWR 2
+#define O_ACCMODE 3      // Mask of the access mode
+#define O_TRUNC 0x200    // Empty the file when it is opened for writing
+
+// SYS_MMAP protections; mappings are private: writes are not carried to the file
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define PROT_EXEC 4
+#define MAP_FAILED ((void*)-1)  // Returned by mmap() on failure
+
+// SYS_LSEEK origins
+#define SEEK_SET 0  // From the start of the file
+#define SEEK_CUR 1  // From the current position
+#define SEEK_END 2  // From the end of the file
+
+// Hardware capabilities reported by SYS_HWCAP
+#define HWCAP_V (1 << 0)  // The vector extension is usable
+
+// Copies and comparisons at least this long use the vector unit (`make VECTOR=1`)
+#define VECTOR_MIN_BYTES 64
 
 void* memset(void* buf, char c, size_t n);
 void* memcpy(void* dst, const void* src, size_t n);
+void* memmove(void* dst, const void* src, size_t n);
+int memcmp(const void* s1, const void* s2, size_t n);
 char* strcpy(char* dst, const char* src);
 int strcmp(const char* s1, const char* s2);
 void printf(const char* fmt, ...);
 int strncmp(const char* s1, const char* s2, size_t n);
-int strlen(const char* s);
\ No newline at end of file
+int strlen(const char* s);
+
+#ifdef CONFIG_VECTOR
+extern bool vector_enabled;
+#endif
\ No newline at end of file
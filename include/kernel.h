@@ -3,19 +3,67 @@
 #include "common.h"
 
 #define SATP_SV32 (1u << 31)   // Enable Sv32 mode
+#define SATP_ASID_SHIFT 22     // Position of the ASID field in satp
+#define SATP_ASID_MASK (0x1ffu << SATP_ASID_SHIFT)  // ASID field of satp (up to 9 bits on Sv32)
 #define PAGE_V (1 << 0)        // Enable bit
 #define PAGE_R (1 << 1)        // Read bit
 #define PAGE_W (1 << 2)        // Write bit
 #define PAGE_X (1 << 3)        // Execute bit
 #define PAGE_U (1 << 4)        // User bit
-#define PROCS_MAX 8            // Maximum number of processes
-#define PROC_UNUSED 0          // Process is not in use
+#define PAGE_G (1 << 5)        // Global bit: the mapping exists in every address space
+#define PAGE_COW (1 << 8)      // Software bit: a page shared read-only by fork(), copied on the first write
+#define MEGAPAGE_SIZE (4 * 1024 * 1024)  // Sv32 level-1 leaf (megapage) size
+#define KERNEL_STACK_SIZE 8192  // Per-process kernel stack size (allocated from the page allocator)
 #define PROC_RUNNABLE 1        // Process is runnable
 #define PROC_EXITED 2          // Process has exited
+#define PROC_BLOCKED 3         // Process is sleeping on a wait queue
+#define PRIO_LEVELS 8          // Number of scheduling priorities (at most 32), 0 is the highest
+#define PRIO_DEFAULT 4         // Priority of a newly created process
+#define FD_MAX 16              // Open file descriptors per process, including the console (0 to 2)
 #define USER_BASE 0x1000000    // Base address of user memory
+#define USER_END 0x1800000     // End of the program's memory: image, bss and stack (see user.ld)
 #define SSTATUS_SPIE (1 << 5)  // Supervisor Previous Interrupt Enable
 #define SCAUSE_ECALL 8         // Environment call from U-mode
+#define SCAUSE_INST_PAGE_FAULT 12   // Instruction page fault
+#define SCAUSE_LOAD_PAGE_FAULT 13   // Load page fault
+#define SCAUSE_STORE_PAGE_FAULT 15  // Store/AMO page fault
+#define SCAUSE_INTERRUPT (1u << 31)  // scause: the trap was caused by an interrupt
+#define IRQ_S_TIMER 5                // Supervisor timer interrupt (scause code and sie/sip bit)
+#define SIE_STIE (1 << IRQ_S_TIMER)  // Supervisor timer interrupt enable
+#define SIP_STIP (1 << IRQ_S_TIMER)  // Supervisor timer interrupt pending
+#define IRQ_S_EXTERNAL 9                   // Supervisor external interrupt (scause code and sie/sip bit)
+#define SIE_SEIE (1 << IRQ_S_EXTERNAL)     // Supervisor external interrupt enable
+#define SIP_SEIP (1 << IRQ_S_EXTERNAL)     // Supervisor external interrupt pending
 #define SSTATUS_SUM (1 << 18)  // Permit supervisor mode to access user memory
+#define SSTATUS_VS (3 << 9)          // Vector unit state: Off, Initial, Clean or Dirty (read-only zero without V)
+#define SSTATUS_VS_INITIAL (1 << 9)
+#define SSTATUS_VS_CLEAN (2 << 9)
+#define SSTATUS_VS_DIRTY (3 << 9)
+#ifdef CONFIG_VECTOR
+#define SSTATUS_USER (SSTATUS_SPIE | SSTATUS_SUM | SSTATUS_VS_CLEAN)  // sstatus when entering a new process
+#else
+#define SSTATUS_USER (SSTATUS_SPIE | SSTATUS_SUM)  // sstatus when entering a new process
+#endif
+#define TIMER_FREQ 10000000    // Frequency of the time CSR on QEMU virt (timebase-frequency in the device tree)
+#define SBI_EXT_TIME 0x54494d45  // SBI Timer extension ("TIME")
+#define SBI_EXT_LEGACY_SET_TIMER 0  // Legacy SBI set_timer, used when the Timer extension is missing
+#define SBI_EXT_LEGACY_PUTCHAR 1    // Legacy SBI console_putchar
+#define SBI_EXT_LEGACY_GETCHAR 2    // Legacy SBI console_getchar
+#define SBI_EXT_BASE 0x10           // SBI Base extension
+#define SBI_BASE_PROBE_EXTENSION 3  // Base function: is an extension available
+#define SBI_EXT_DBCN 0x4442434e     // SBI Debug Console extension ("DBCN")
+#define SBI_DBCN_WRITE 0            // Debug Console function: write a buffer
+#define CONSOLE_BUF_SIZE 1024       // Buffered console output (a power of two)
+
+// Length of a scheduling time slice, override with `make TIME_SLICE_MS=n`
+#ifndef TIME_SLICE_MS
+#define TIME_SLICE_MS 10
+#endif
+
+// Delay before modified files are written back, override with `make FS_FLUSH_MS=n` (0 writes back on every write)
+#ifndef FS_FLUSH_MS
+#define FS_FLUSH_MS 1000
+#endif
 
 struct sbiret {
     long error;
@@ -23,8 +71,10 @@ struct sbiret {
 };
 
 // Display the error and halt. Its a macro so that we can get the file and line number of the error correctly.
+// The console is switched to synchronous output first, so the message is not left in a buffer.
 #define PANIC(fmt, ...)                                                       \
     do {                                                                      \
+        console_sync();                                                       \
         printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
         while (1) {                                                           \
         }                                                                     \
@@ -77,45 +127,127 @@ struct trap_frame {
         __asm__ __volatile__("csrw " #reg ", %0" ::"r"(__tmp)); \
     } while (0)
 
+// An open file descriptor
+struct fd {
+    struct file* file;  // The file, or NULL if the descriptor is not in use
+    unsigned offset;    // Position of the next read or write
+    int flags;          // Flags given to SYS_OPEN
+};
+
 struct process {
     int pid;               // Process ID
     int state;             // Process state
     vaddr_t sp;            // Stack pointer
     uint32_t* page_table;  // Page table
-    uint8_t stack[8192];   // 8KB stack
+    uint32_t asid;         // Address space ID tagging this process's TLB entries
+    uint32_t asid_gen;     // ASID generation the asid was allocated in
+    int priority;          // Scheduling priority, 0 is the highest
+    struct process* rq_next;  // Next process in the same run queue or wait queue list
+    uint8_t* stack;        // Kernel stack (KERNEL_STACK_SIZE bytes)
+    uint8_t* vstate;       // Saved vector registers, allocated with the process if the unit is used (`make VECTOR=1`)
+    struct fd fds[FD_MAX];  // Open files; descriptors 0 to 2 are the console and have no entry
+    struct vma* vmas;      // Mapped regions filled in on page faults, sorted by address
+};
+
+// Run queue: a FIFO list of runnable processes per priority, and a bitmap of the non-empty lists
+struct run_queue {
+    struct process* head[PRIO_LEVELS];
+    struct process* tail[PRIO_LEVELS];
+    uint32_t bitmap;  // Bit n is set when the list of priority n is not empty
+};
+
+// Wait queue: a FIFO list of processes blocked on an event, linked through rq_next
+struct wait_queue {
+    struct process* head;
+    struct process* tail;
 };
 
 // Process management
 
 __attribute__((naked)) void switch_context(uint32_t* prev_sp, uint32_t* next_sp);
 struct process* create_process(const void* image, size_t image_size);
+struct process* fork_process(struct trap_frame* f, uint32_t user_pc);
+void map_kernel(uint32_t* page_table);
 void handle_trap(struct trap_frame* f);
+__attribute__((noreturn)) void exit_process(void);
 void trap_handler(struct trap_frame* tf);
 void yield(void);
+void destroy_process(struct process* proc);
+void runqueue_push(struct process* proc);
+struct process* runqueue_pop(void);
+void sleep_on(struct wait_queue* wq);
+void wake_up(struct wait_queue* wq);
+bool can_sleep(void);
+void timer_tick(void);
 void handle_syscall(struct trap_frame* f);
+void asid_init(void);
+void timer_init(void);
 
 // Memory management
-#define NUM_PAGES 16384
+#define NUM_PAGES 16384       // Number of page frames in the free RAM pool (64MB)
+#define MAX_ORDER 14          // Largest buddy block is 2^MAX_ORDER pages
+#define PAGE_ORDER_FREE 0x80  // page_order[] flag: the block starting at this page frame is free
+#define PAGE_ORDER_TAIL 0x40  // page_order[] value: the page frame is inside a block, not at its start
+
+// Links of a free buddy block, stored in the first bytes of the block itself
+struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+};
+
+// Buddy allocator over the free RAM pool
 struct free_list {
-    // Free list of physical pages (page frame addresses)
-    paddr_t page_frame_addr[NUM_PAGES];
-    // Index of the first free page frame
-    uint32_t page_frame_free;
+    // Free blocks of 2^order contiguous pages, one list per order
+    struct free_block* free_area[MAX_ORDER + 1];
+    // Order of the block starting at each page frame, or'ed with PAGE_ORDER_FREE while the block is free, or
+    // PAGE_ORDER_TAIL for the other page frames of a block. Lives at the start of free RAM and is only valid below the
+    // bump pointer.
+    uint8_t* page_order;
+    // References to the block starting at each page frame (pages shared by fork()), stored after page_order[]. Only
+    // valid for allocated blocks.
+    uint16_t* page_refs;
+    // Physical address of the first page frame and number of page frames in the pool
+    paddr_t base;
+    size_t num_pages;
+    // Page frames at and above this index have never been handed out
+    size_t bump;
 };
 
 void init_free_list(struct free_list* free_list);
+paddr_t try_alloc_page(struct free_list* free_list, size_t n);
 paddr_t alloc_page(struct free_list* free_list, size_t n);
-void free_page(struct free_list* free_list, paddr_t paddr);
+void free_page(struct free_list* free_list, paddr_t paddr, size_t n);
+void ref_page(struct free_list* free_list, paddr_t paddr);
+unsigned page_refcount(struct free_list* free_list, paddr_t paddr);
 void map_page(uint32_t* page_table, vaddr_t va, paddr_t pa, uint32_t flags);
+void map_megapage(uint32_t* page_table, vaddr_t va, paddr_t pa, uint32_t flags);
+void free_page_table(uint32_t* page_table);
 
 extern struct free_list page_list;
+extern struct process* current_proc;
+extern struct process* idle_proc;
+extern struct wait_queue console_wq;
+extern uint32_t asid_max;
 
 // Misc
 
 __attribute__((section(".text.boot"))) __attribute__((naked)) void boot(void);
 __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void);
 __attribute__((naked)) void user_entry(void);
+__attribute__((naked)) void fork_entry(void);
 struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4, long arg5, long fid, long eid);
 void putchar(char ch);
+void console_init(void);
+void console_write(const char* buf, size_t len);
+void console_flush(void);
+void console_sync(void);
 void kernel_main(void);
+void bench_run(void);
+void vector_init(void);
+void vector_trap_enter(void);
+void vector_trap_exit(void);
+void vector_switch(void);
+bool vector_alloc(struct process* proc);
+bool vector_fork(struct process* child);
+void vector_free(struct process* proc);
 long getchar(void);
\ No newline at end of file
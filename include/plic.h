@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common.h"
+
+#define PLIC_BASE 0x0c000000  // Platform-Level Interrupt Controller on QEMU virt
+#define PLIC_NUM_IRQS 64      // Interrupt sources handled by the driver (QEMU virt uses 1..53)
+#define PLIC_HART 0           // Hart receiving the interrupts
+#define PLIC_PRIORITY(irq) (PLIC_BASE + (irq) * 4)                           // Source priority (0 disables it)
+#define PLIC_SENABLE(hart) (PLIC_BASE + 0x2080 + (hart) * 0x100)             // S-mode context enable bits
+#define PLIC_STHRESHOLD(hart) (PLIC_BASE + 0x201000 + (hart) * 0x2000)       // S-mode context priority threshold
+#define PLIC_SCLAIM(hart) (PLIC_BASE + 0x201004 + (hart) * 0x2000)           // S-mode context claim/complete
+#define VIRTIO0_IRQ 1  // IRQ of the first virtio-mmio slot; slot n uses VIRTIO0_IRQ + n
+
+void plic_init(void);
+void plic_enable(unsigned irq, void (*handler)(void* arg), void* arg);
+void plic_handle(void);
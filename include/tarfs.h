@@ -1,8 +1,9 @@
 #pragma once
 #include "kernel.h"
 
-#define FILES_MAX 2
-#define DISK_MAX_SIZE align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
+#define TAR_NAME_MAX 257                   // Longest path (155-byte ustar prefix, '/', 100-byte name) and the NUL
+#define TAR_END_SIZE (2 * SECTOR_SIZE)      // The end-of-archive marker is two zero blocks
+#define FS_HASH_MIN (PAGE_SIZE / sizeof(struct file*))  // Initial number of hash buckets
 
 struct tar_header {
     char name[100];      // Name of the file or directory
@@ -25,13 +26,21 @@ struct tar_header {
     char data[];         // Array pointing to the data area following the header
 } __attribute__((packed));
 
+// An entry of the file index. The data stays on the disk, right after the tar header at `offset`.
 struct file {
-    bool in_use;      // Is this file slot in use?
-    char name[100];   // File name
-    char data[1024];  // File data
-    size_t size;      // File size
+    char name[TAR_NAME_MAX];  // File name, including the ustar prefix
+    unsigned offset;          // Offset of the tar header in the archive
+    size_t size;              // File size
+    struct file* hash_next;   // Next file in the same hash bucket
+    struct file* next;        // Next file in archive order
+    bool dirty;               // Is the tar header out of date?
+    struct file* dirty_next;  // Next file whose header is out of date
 };
 
 void fs_init(void);
 struct file* fs_lookup(const char* filename);
-void fs_flush(void);
\ No newline at end of file
+int fs_read(const struct file* file, unsigned offset, void* buf, size_t len);
+int fs_write(struct file* file, unsigned offset, const void* buf, size_t len);
+int fs_truncate(struct file* file, size_t size);
+void fs_flush(void);
+void fs_tick(void);
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.h"
+
+#define UART_BASE 0x10000000  // NS16550A UART on QEMU virt
+#define UART_IRQ 10           // PLIC interrupt source of the UART
+#define UART_RX_SIZE 256      // Received characters not yet read (a power of two)
+#define UART_TX_SIZE 1024     // Characters waiting for the transmitter (a power of two)
+#define UART_FIFO_SIZE 16     // Depth of the 16550 transmit FIFO
+#define UART_RBR 0            // Receive buffer (read)
+#define UART_THR 0            // Transmit holding register (write)
+#define UART_IER 1            // Interrupt enable
+#define UART_IIR 2            // Interrupt identification (read)
+#define UART_FCR 2            // FIFO control (write)
+#define UART_LCR 3            // Line control
+#define UART_MCR 4            // Modem control
+#define UART_LSR 5            // Line status
+#define UART_IER_RDI (1 << 0)     // Interrupt when received data is available
+#define UART_IER_THRI (1 << 1)    // Interrupt when the transmit holding register is empty
+#define UART_IIR_NO_INT (1 << 0)  // No interrupt pending
+#define UART_FCR_ENABLE (1 << 0)  // Enable the FIFOs
+#define UART_FCR_CLEAR (3 << 1)   // Clear the receive and transmit FIFOs
+#define UART_LCR_8N1 0x03         // 8 data bits, no parity, one stop bit
+#define UART_MCR_OUT2 (1 << 3)    // Routes the UART interrupt to the interrupt controller
+#define UART_LSR_DR (1 << 0)      // Data ready
+#define UART_LSR_THRE (1 << 5)    // Transmit holding register (and FIFO) empty
+
+void uart_init(void);
+void uart_putchar(char ch);
+void uart_putchar_sync(char ch);
+void uart_tx_start(void);
+long uart_getchar(void);
@@ -4,6 +4,18 @@
 __attribute__((noreturn)) void exit(void);
 void putchar(char ch);
 int getchar(void);
+void flush(void);
+void user_init(void);
+int write(int fd, const void* buf, int len);
+int open(const char* filename, int flags);
+int read(int fd, void* buf, int len);
+int lseek(int fd, int offset, int whence);
+int close(int fd);
+void* mmap(int fd, int len, int prot);
+int munmap(void* addr);
 int syscall(int sysno, int arg0, int arg1, int arg2);
 int readfile(const char* filename, char* buf, int len);
-int writefile(const char* filename, const char* buf, int len);
\ No newline at end of file
+int writefile(const char* filename, const char* buf, int len);
+int setprio(int prio);
+int sync(void);
+int fork(void);
\ No newline at end of file
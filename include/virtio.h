@@ -1,14 +1,32 @@
 #pragma once
 
-#include "common.h"
+#include "kernel.h"
 
 #define SECTOR_SIZE 512
-#define VIRTQ_ENTRY_NUM 16
+#define VIRTQ_NUM_MAX 256            // Largest queue the driver sets up (the device may offer less)
+#define VIRTIO_BLK_INDIRECT_NUM 64  // Descriptors in the indirect table of each request (header, segments and status)
+#define VIRTIO_BLK_SEGS_MAX (VIRTIO_BLK_INDIRECT_NUM - 2)  // Data segments per request
+#define VIRTIO_BLK_BATCH_MAX 64     // Requests submitted with a single notification
+#define VIRTIO_BLK_MAX 4            // virtio-blk devices handled by the driver
+#define VIRTIO_CONSOLE_BUF_SIZE 128  // Bytes per virtio-console transfer buffer
+#define VIRTIO_CONSOLE_RX_BUFS 8     // Receive buffers kept available to the virtio-console
+#define VIRTIO_CONSOLE_INPUT_SIZE 256  // Received characters not yet read by getchar()
+#define VIRTIO_CONSOLE_RX_QUEUE 0
+#define VIRTIO_CONSOLE_TX_QUEUE 1
 #define VIRTIO_DEVICE_BLK 2
-#define VIRTIO_BLK_PADDR 0x10001000
+#define VIRTIO_DEVICE_CONSOLE 3
+#define VIRTIO_MMIO_BASE 0x10001000  // First virtio-mmio slot on QEMU virt
+#define VIRTIO_MMIO_STRIDE 0x1000    // Distance between the slots
+#define VIRTIO_MMIO_SLOTS 8
+#define VIRTIO_MAGIC 0x74726976      // "virt"
 #define VIRTIO_REG_MAGIC 0x00
 #define VIRTIO_REG_VERSION 0x04
 #define VIRTIO_REG_DEVICE_ID 0x08
+#define VIRTIO_REG_DEVICE_FEATURES 0x10
+#define VIRTIO_REG_DEVICE_FEATURES_SEL 0x14
+#define VIRTIO_REG_DRIVER_FEATURES 0x20
+#define VIRTIO_REG_DRIVER_FEATURES_SEL 0x24
+#define VIRTIO_REG_GUEST_PAGE_SIZE 0x28
 #define VIRTIO_REG_QUEUE_SEL 0x30
 #define VIRTIO_REG_QUEUE_NUM_MAX 0x34
 #define VIRTIO_REG_QUEUE_NUM 0x38
@@ -16,17 +34,39 @@
 #define VIRTIO_REG_QUEUE_PFN 0x40
 #define VIRTIO_REG_QUEUE_READY 0x44
 #define VIRTIO_REG_QUEUE_NOTIFY 0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK 0x64
 #define VIRTIO_REG_DEVICE_STATUS 0x70
+#define VIRTIO_REG_QUEUE_DESC_LOW 0x80
+#define VIRTIO_REG_QUEUE_DESC_HIGH 0x84
+#define VIRTIO_REG_QUEUE_DRIVER_LOW 0x90
+#define VIRTIO_REG_QUEUE_DRIVER_HIGH 0x94
+#define VIRTIO_REG_QUEUE_DEVICE_LOW 0xa0
+#define VIRTIO_REG_QUEUE_DEVICE_HIGH 0xa4
 #define VIRTIO_REG_DEVICE_CONFIG 0x100
+#define VIRTIO_BLK_CFG_CAPACITY 0x00  // Device configuration: capacity in sectors (64-bit)
+#define VIRTIO_BLK_CFG_SIZE_MAX 0x08  // Device configuration: maximum size of a segment
+#define VIRTIO_BLK_CFG_SEG_MAX 0x0c   // Device configuration: maximum number of segments in a request
+#define VIRTIO_BLK_CFG_BLK_SIZE 0x14  // Device configuration: preferred block size
 #define VIRTIO_STATUS_ACK 1
 #define VIRTIO_STATUS_DRIVER 2
 #define VIRTIO_STATUS_DRIVER_OK 4
 #define VIRTIO_STATUS_FEAT_OK 8
 #define VIRTQ_DESC_F_NEXT 1
 #define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
 #define VIRTQ_AVAIL_F_NO_INTERRUPT 1
 #define VIRTIO_BLK_T_IN 0
 #define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_F_SIZE_MAX (1u << 1)         // Feature: size_max is valid
+#define VIRTIO_BLK_F_SEG_MAX (1u << 2)          // Feature: seg_max is valid
+#define VIRTIO_BLK_F_BLK_SIZE (1u << 6)         // Feature: blk_size is valid
+#define VIRTIO_BLK_F_FLUSH (1u << 9)            // Feature: the flush command is supported
+#define VIRTIO_RING_F_INDIRECT_DESC (1u << 28)  // Feature: descriptors may point to indirect tables
+#define VIRTIO_F_VERSION_1 (1u << 0)  // Feature bit 32 (in the second feature word): the device follows virtio 1.0+
+#define VIRTIO_BLK_DRIVER_FEATURES \
+    (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | VIRTIO_RING_F_INDIRECT_DESC)
 
 struct virtq_desc {
     uint64_t addr;
@@ -38,7 +78,7 @@ struct virtq_desc {
 struct virtq_avail {
     uint16_t flags;
     uint16_t index;
-    uint16_t ring[VIRTQ_ENTRY_NUM];
+    uint16_t ring[];  // num entries, followed by used_event
 } __attribute__((packed));
 
 struct virtq_used_elem {
@@ -49,31 +89,88 @@ struct virtq_used_elem {
 struct virtq_used {
     uint16_t flags;
     uint16_t index;
-    struct virtq_used_elem ring[VIRTQ_ENTRY_NUM];
+    struct virtq_used_elem ring[];  // num entries, followed by avail_event
 } __attribute__((packed));
 
+// A virtio-mmio device found by virtio_init()
+struct virtio_dev {
+    paddr_t base;       // Register base of the slot
+    unsigned irq;       // PLIC interrupt source of the slot
+    uint32_t version;   // Transport version: 1 (legacy) or 2 (modern)
+    uint32_t features;  // Negotiated feature bits (first word)
+};
+
+// A split virtqueue. The rings are sized at runtime and live in the same allocation, laid out as the legacy
+// transport expects (the used ring on its own page); the modern transport is given the three addresses.
 struct virtio_virtq {
-    struct virtq_desc descs[VIRTQ_ENTRY_NUM];
-    struct virtq_avail avail;
-    struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
+    struct virtio_dev* dev;  // Device owning the queue
+    struct virtq_desc* descs;
+    struct virtq_avail* avail;
+    struct virtq_used* used;
+    unsigned num;  // Queue size, a power of two
     int queue_index;
     volatile uint16_t* used_index;
-    uint16_t last_used_index;
-} __attribute__((packed));
+    uint16_t last_used_index;  // Next used ring entry to collect
+    uint16_t free_head;        // First descriptor of the free list (chained through next)
+    uint16_t num_free;         // Number of free descriptors
+};
 
 /**
  * struct virtio_blk_req - VirtIO block request structure
  * This structure represents a VirtIO block request. It contains the type of the request, a reserved field for future use, the
- * sector number of the request, a data buffer for the request, and the status of the request.
+ * sector number of the request, and the status of the request. The data is not part of it: the descriptor chain points at the
+ * caller's buffers. The driver keeps one per descriptor so that several requests can be in flight.
  */
 struct virtio_blk_req {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-    uint8_t data[512];
     uint8_t status;
 } __attribute__((packed));
 
-void virtio_blk_init(void);
-void read_write_disk(void* buf, unsigned sector, int is_write);
-struct virtio_virtq* virtq_init(unsigned index);
\ No newline at end of file
+// A virtio-blk device and the state of its requests
+struct virtio_blk {
+    struct virtio_dev dev;
+    struct virtio_virtq* vq;
+    struct virtio_blk_req* reqs;  // Header and status of every request, indexed by the head descriptor of its chain
+    paddr_t reqs_paddr;           // Physical address of reqs
+    bool* done;                   // done[id] is set once the device has returned the chain starting at descriptor id
+    struct virtq_desc* indirect;  // Indirect descriptor table of every request, indexed like reqs (NULL if not negotiated)
+    unsigned capacity;            // Capacity in bytes
+    unsigned max_segs;            // Data segments per request
+    uint32_t size_max;            // Bytes per data segment
+    unsigned blk_size;            // Block size preferred by the device: a power of two, SECTOR_SIZE to PAGE_SIZE
+    struct wait_queue wq;         // Processes waiting for a request to complete or for free descriptors
+};
+
+// A segment of a scatter-gather block request
+struct blk_iovec {
+    void* buf;   // Kernel (identity mapped) buffer
+    size_t len;  // Length in bytes, a multiple of SECTOR_SIZE
+};
+
+void virtio_init(void);
+uint32_t virtio_reg_read32(struct virtio_dev* dev, unsigned offset);
+void virtio_reg_write32(struct virtio_dev* dev, unsigned offset, uint32_t value);
+void virtio_dev_negotiate(struct virtio_dev* dev, uint32_t driver_features);
+void virtio_dev_ready(struct virtio_dev* dev);
+struct virtio_virtq* virtq_init(struct virtio_dev* dev, unsigned index);
+int virtq_alloc_desc(struct virtio_virtq* vq);
+void virtq_free_chain(struct virtio_virtq* vq, int head);
+void virtq_push(struct virtio_virtq* vq, int desc_index);
+void virtq_notify(struct virtio_virtq* vq);
+void virtio_blk_init(struct virtio_blk* blk, const struct virtio_dev* dev);
+void virtio_blk_irq(void* arg);
+int virtio_blk_submitv(struct virtio_blk* blk, const struct blk_iovec* iov, int iovcnt, unsigned sector, int is_write);
+int virtio_blk_complete(struct virtio_blk* blk, int id);
+int virtio_blk_flush(struct virtio_blk* blk);
+void read_write_disk(struct virtio_blk* blk, void* buf, unsigned sector, int is_write);
+int read_write_disk_sectors(struct virtio_blk* blk, void* buf, unsigned sector, unsigned count, int is_write);
+int read_write_disk_vec(struct virtio_blk* blk, const struct blk_iovec* iov, int iovcnt, unsigned sector, int is_write);
+void virtio_console_init(const struct virtio_dev* dev);
+bool virtio_console_putchar(char ch);
+void virtio_console_flush(void);
+long virtio_console_getchar(void);
+
+extern struct virtio_blk blk_devs[VIRTIO_BLK_MAX];
+extern int blk_count;
\ No newline at end of file
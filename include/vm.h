@@ -0,0 +1,28 @@
+#pragma once
+
+#include "kernel.h"
+#include "tarfs.h"
+
+#define MMAP_BASE 0x2000000  // mmap() regions are placed above the user image...
+#define MMAP_END 0xc000000   // ...and below the PLIC, the first kernel mapping
+
+// A mapped region of a process. Its pages are allocated, and read from the file or the image, on the first access.
+struct vma {
+    vaddr_t start;         // First address, page aligned
+    vaddr_t end;           // Address past the end, page aligned
+    int prot;              // PROT_READ, PROT_WRITE and PROT_EXEC
+    struct file* file;     // Backing file, or NULL for zero-filled memory
+    unsigned offset;       // Offset in the file of `start`
+    const uint8_t* image;  // Backing program image at `start` (instead of a file), or NULL
+    size_t image_size;     // Bytes of the image; the rest of the region is zero-filled
+    struct vma* next;      // Next region, at a higher address
+};
+
+void vm_map_image(struct process* proc, const void* image, size_t image_size);
+vaddr_t vm_mmap(struct file* file, size_t len, int prot);
+int vm_munmap(vaddr_t addr);
+bool vm_fault(vaddr_t addr, int access);
+bool vm_access(const void* buf, size_t len, int access);
+bool vm_access_string(const char* str);
+bool vm_fork(struct process* child);
+void vm_free(struct process* proc);
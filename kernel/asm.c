@@ -54,15 +54,19 @@ __attribute__((naked)) void switch_context(uint32_t* prev_sp, uint32_t* next_sp)
  * generated by the compiler. Instead, the function must manually save and restore the registers that it uses. The function uses
  * inline assembly to set the values of the sepc and sstatus registers before performing the sret instruction.
  *
- * @note This function assumes that the USER_BASE and SSTATUS_SPIE constants are defined elsewhere in the code.
+ * @note This function assumes that the USER_BASE and SSTATUS_USER constants are defined elsewhere in the code.
  */
 __attribute__((naked)) void user_entry(void) {
     __asm__ __volatile__(
         "csrw sepc, %[sepc]\n"
         "csrw sstatus, %[sstatus]\n"
+#ifdef CONFIG_VECTOR
+        // Load the new process's (zeroed) vector registers instead of whatever the unit holds
+        "call vector_trap_exit\n"
+#endif
         "sret\n"
         :
-        : [sepc] "r"(USER_BASE), [sstatus] "r"(SSTATUS_SPIE | SSTATUS_SUM));
+        : [sepc] "r"(USER_BASE), [sstatus] "r"(SSTATUS_USER));
 }
 
 /**
@@ -122,6 +126,9 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
         "mv a0, sp\n"
         "call handle_trap\n"
 
+        // fork_entry() returns to user mode from here
+        "trap_return:\n"
+
         "lw ra,  4 * 0(sp)\n"
         "lw gp,  4 * 1(sp)\n"
         "lw tp,  4 * 2(sp)\n"
@@ -156,6 +163,22 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
         "sret\n");
 }
 
+/**
+ * The first code run by a process created by fork_process(): switch_context() returns here with sp on the copy of the
+ * parent's trap frame and s0 holding the user program counter, and the trap frame is restored as after a trap.
+ */
+__attribute__((naked)) void fork_entry(void) {
+    __asm__ __volatile__(
+        "csrw sepc, s0\n"
+        "csrw sstatus, %[sstatus]\n"
+#ifdef CONFIG_VECTOR
+        "call vector_trap_exit\n"
+#endif
+        "j trap_return\n"
+        :
+        : [sstatus] "r"(SSTATUS_USER));
+}
+
 /**
  * @brief This function is the entry point of the kernel. It sets the stack pointer to the top of the stack and jumps to
  * the kernel_main function.
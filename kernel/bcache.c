@@ -0,0 +1,322 @@
+#include "bcache.h"
+
+// The block cache sits between the file system and the virtio-blk driver. Blocks are looked up in a hash table and
+// evicted with the CLOCK algorithm; modified sectors are written back on eviction or by bcache_flush(). A miss right
+// after the previous one reads the following BCACHE_READAHEAD blocks in the same scatter-gather request. Sectors are
+// read, written back and marked valid or dirty in whole device blocks (blk_size), so the device sees aligned requests.
+// The cache is not reentrant: it may sleep on the device, so callers serialize their accesses (tarfs holds its lock).
+struct bcache_buf bcache_bufs[BCACHE_BLOCKS];
+struct bcache_buf* bcache_hash[BCACHE_HASH_SIZE];
+unsigned bcache_hand;  // Clock hand: next buffer considered for eviction
+struct bcache_stats bcache_stats;
+// The block a sequential reader would miss next, to detect sequential access.
+struct virtio_blk* bcache_seq_blk;
+unsigned bcache_seq_block;
+
+/**
+ * Allocates the cache blocks.
+ */
+void bcache_init(void) {
+    uint8_t* data = (uint8_t*)alloc_page(&page_list, BCACHE_BLOCKS * BCACHE_BLOCK_SIZE / PAGE_SIZE);
+    for (int i = 0; i < BCACHE_BLOCKS; i++)
+        bcache_bufs[i].data = data + i * BCACHE_BLOCK_SIZE;
+}
+
+/**
+ * Returns the hash bucket of a block.
+ */
+static struct bcache_buf** bcache_bucket(struct virtio_blk* blk, unsigned block) {
+    return &bcache_hash[(block * 2654435761u + (paddr_t)blk) & (BCACHE_HASH_SIZE - 1)];
+}
+
+/**
+ * Looks up a cached block.
+ *
+ * @return The buffer, or NULL if the block is not cached.
+ */
+static struct bcache_buf* bcache_lookup(struct virtio_blk* blk, unsigned block) {
+    for (struct bcache_buf* buf = *bcache_bucket(blk, block); buf; buf = buf->hash_next) {
+        if (buf->blk == blk && buf->block == block)
+            return buf;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the sectors of a block that lie on the device (all of them, except in the last block of a disk whose size
+ * is not a multiple of the block size).
+ */
+static uint8_t bcache_sectors(struct virtio_blk* blk, unsigned block) {
+    const unsigned left = blk->capacity / SECTOR_SIZE - block * BCACHE_BLOCK_SECTORS;
+    return left >= BCACHE_BLOCK_SECTORS ? 0xff : (1 << left) - 1;
+}
+
+/**
+ * Widens a sector mask of a block to the whole device blocks (blk_size) it overlaps.
+ */
+static uint8_t bcache_align(struct virtio_blk* blk, uint8_t mask) {
+    const unsigned n = blk->blk_size / SECTOR_SIZE;
+    const uint8_t group = (1 << n) - 1;
+    uint8_t aligned = 0;
+    for (unsigned i = 0; i < BCACHE_BLOCK_SECTORS; i += n) {
+        if (mask & (group << i))
+            aligned |= group << i;
+    }
+    return aligned;
+}
+
+/**
+ * Writes the dirty sectors of a buffer to the device, one request per run of consecutive dirty sectors.
+ *
+ * @return 0 on success, or -1 if a write failed (the sectors that were not written stay dirty).
+ */
+static int bcache_writeback(struct bcache_buf* buf) {
+    for (unsigned first = 0; first < BCACHE_BLOCK_SECTORS;) {
+        if (!(buf->dirty & (1 << first))) {
+            first++;
+            continue;
+        }
+
+        unsigned end = first;
+        while (end < BCACHE_BLOCK_SECTORS && (buf->dirty & (1 << end)))
+            end++;
+        const unsigned sector = buf->block * BCACHE_BLOCK_SECTORS + first;
+        if (read_write_disk_sectors(buf->blk, buf->data + first * SECTOR_SIZE, sector, end - first, true) < 0)
+            return -1;
+        buf->dirty &= ~(((1 << (end - first)) - 1) << first);
+        bcache_stats.writebacks++;
+        first = end;
+    }
+    return 0;
+}
+
+/**
+ * Takes a buffer for a new block, evicting the first buffer the clock hand finds unreferenced. A dirty victim is written
+ * back first.
+ *
+ * @param blk The device.
+ * @param block The block number.
+ * @return The buffer, in the hash table, with no valid sectors.
+ * @throws PANIC if a dirty victim cannot be written back.
+ */
+static struct bcache_buf* bcache_alloc(struct virtio_blk* blk, unsigned block) {
+    struct bcache_buf* buf;
+    while (1) {
+        buf = &bcache_bufs[bcache_hand];
+        bcache_hand = (bcache_hand + 1) % BCACHE_BLOCKS;
+        if (!buf->referenced)
+            break;
+        buf->referenced = false;
+    }
+
+    if (buf->blk) {
+        if (buf->dirty && bcache_writeback(buf) < 0)
+            PANIC("bcache: failed to write back block %d", buf->block);
+
+        struct bcache_buf** prev = bcache_bucket(buf->blk, buf->block);
+        while (*prev != buf)
+            prev = &(*prev)->hash_next;
+        *prev = buf->hash_next;
+    }
+
+    buf->blk = blk;
+    buf->block = block;
+    buf->valid = 0;
+    buf->dirty = 0;
+    // A new buffer survives the next pass of the clock hand, so that read-ahead cannot evict its own blocks
+    buf->referenced = true;
+    struct bcache_buf** bucket = bcache_bucket(blk, block);
+    buf->hash_next = *bucket;
+    *bucket = buf;
+    return buf;
+}
+
+/**
+ * Reads the sectors of a cached block that are requested but not valid yet, one request per run.
+ *
+ * @return 0 on success, or -1 if a read failed.
+ */
+static int bcache_fill(struct bcache_buf* buf, uint8_t need) {
+    need &= ~buf->valid;
+    for (unsigned first = 0; first < BCACHE_BLOCK_SECTORS;) {
+        if (!(need & (1 << first))) {
+            first++;
+            continue;
+        }
+
+        unsigned end = first;
+        while (end < BCACHE_BLOCK_SECTORS && (need & (1 << end)))
+            end++;
+        const unsigned sector = buf->block * BCACHE_BLOCK_SECTORS + first;
+        if (read_write_disk_sectors(buf->blk, buf->data + first * SECTOR_SIZE, sector, end - first, false) < 0)
+            return -1;
+        buf->valid |= ((1 << (end - first)) - 1) << first;
+        first = end;
+    }
+    return 0;
+}
+
+/**
+ * Returns a cached block whose `need` sectors are valid. On a miss the whole block is read; a miss on the block after
+ * the previous miss also reads the next blocks that are not cached, up to BCACHE_READAHEAD in all, in one request.
+ *
+ * @param blk The device.
+ * @param block The block number.
+ * @param need The sectors the caller reads (or partly overwrites), 0 if it overwrites whole sectors only.
+ * @return The buffer, or NULL if the device failed.
+ */
+static struct bcache_buf* bcache_get(struct virtio_blk* blk, unsigned block, uint8_t need) {
+    need = bcache_align(blk, need) & bcache_sectors(blk, block);
+    struct bcache_buf* buf = bcache_lookup(blk, block);
+    if (buf) {
+        buf->referenced = true;
+        if ((buf->valid & need) == need) {
+            bcache_stats.hits++;
+            return buf;
+        }
+        bcache_stats.misses++;
+        return bcache_fill(buf, need) < 0 ? NULL : buf;
+    }
+
+    buf = bcache_alloc(blk, block);
+    if (!need)
+        return buf;
+
+    bcache_stats.misses++;
+    const unsigned blocks = align_up(blk->capacity, BCACHE_BLOCK_SIZE) / BCACHE_BLOCK_SIZE;
+    const int count = blk == bcache_seq_blk && block == bcache_seq_block ? BCACHE_READAHEAD : 1;
+    struct bcache_buf* bufs[BCACHE_READAHEAD] = {buf};
+    int n = 1;
+    while (n < count && block + n < blocks && !bcache_lookup(blk, block + n)) {
+        bufs[n] = bcache_alloc(blk, block + n);
+        n++;
+    }
+
+    struct blk_iovec iov[BCACHE_READAHEAD];
+    for (int i = 0; i < n; i++) {
+        iov[i].buf = bufs[i]->data;
+        iov[i].len = __builtin_popcount(bcache_sectors(blk, block + i)) * SECTOR_SIZE;
+    }
+
+    if (read_write_disk_vec(blk, iov, n, block * BCACHE_BLOCK_SECTORS, false) < 0) {
+        // Leave the buffers empty; they are reused first since nothing refers to them
+        for (int i = 0; i < n; i++)
+            bufs[i]->referenced = false;
+        return NULL;
+    }
+
+    for (int i = 0; i < n; i++)
+        bufs[i]->valid = bcache_sectors(blk, block + i);
+    bcache_stats.readahead += n - 1;
+    bcache_seq_blk = blk;
+    bcache_seq_block = block + n;
+    return buf;
+}
+
+/**
+ * Returns the sectors of a block overlapping the byte range [start, end) of the block.
+ */
+static uint8_t bcache_mask(unsigned start, unsigned end) {
+    const unsigned first = start / SECTOR_SIZE;
+    const unsigned last = (end - 1) / SECTOR_SIZE;
+    return ((1 << (last - first + 1)) - 1) << first;
+}
+
+/**
+ * Reads bytes from a device through the cache.
+ *
+ * @param blk The device.
+ * @param offset The byte offset on the device.
+ * @param buf The destination.
+ * @param len The number of bytes.
+ * @return 0 on success, or -1 if the range is past the end of the device or the device failed.
+ */
+int bcache_read(struct virtio_blk* blk, unsigned offset, void* buf, size_t len) {
+    if (offset > blk->capacity || len > blk->capacity - offset)
+        return -1;
+
+    uint8_t* dst = buf;
+    while (len > 0) {
+        const unsigned start = offset % BCACHE_BLOCK_SIZE;
+        const unsigned n = len < BCACHE_BLOCK_SIZE - start ? len : BCACHE_BLOCK_SIZE - start;
+        const struct bcache_buf* b = bcache_get(blk, offset / BCACHE_BLOCK_SIZE, bcache_mask(start, start + n));
+        if (!b)
+            return -1;
+
+        memcpy(dst, b->data + start, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes bytes to a device through the cache. The modified sectors are written back when their block is evicted or on
+ * bcache_flush(); device blocks that are only partly overwritten are read first.
+ *
+ * @param blk The device.
+ * @param offset The byte offset on the device.
+ * @param buf The source, or NULL to write zeros.
+ * @param len The number of bytes.
+ * @return 0 on success, or -1 if the range is past the end of the device or the device failed.
+ */
+int bcache_write(struct virtio_blk* blk, unsigned offset, const void* buf, size_t len) {
+    if (offset > blk->capacity || len > blk->capacity - offset)
+        return -1;
+
+    const uint8_t* src = buf;
+    while (len > 0) {
+        const unsigned start = offset % BCACHE_BLOCK_SIZE;
+        const unsigned n = len < BCACHE_BLOCK_SIZE - start ? len : BCACHE_BLOCK_SIZE - start;
+        const uint8_t touched = bcache_align(blk, bcache_mask(start, start + n)) & bcache_sectors(blk, offset / BCACHE_BLOCK_SIZE);
+        // The first and last device blocks need reading unless the range covers them completely
+        uint8_t need = 0;
+        if (start % blk->blk_size)
+            need |= bcache_mask(start, start + 1);
+        if ((start + n) % blk->blk_size)
+            need |= bcache_mask(start + n - 1, start + n);
+
+        struct bcache_buf* b = bcache_get(blk, offset / BCACHE_BLOCK_SIZE, need);
+        if (!b)
+            return -1;
+
+        if (src) {
+            memcpy(b->data + start, src, n);
+            src += n;
+        } else {
+            memset(b->data + start, 0, n);
+        }
+        b->valid |= touched;
+        b->dirty |= touched;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes every modified sector of a device back and makes it durable.
+ *
+ * @param blk The device.
+ * @return The number of sectors written, or -1 if a write failed (its sectors stay dirty for the next flush).
+ */
+int bcache_flush(struct virtio_blk* blk) {
+    int written = 0;
+    int ret = 0;
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        struct bcache_buf* buf = &bcache_bufs[i];
+        if (buf->blk != blk || !buf->dirty)
+            continue;
+
+        const int sectors = __builtin_popcount(buf->dirty);
+        if (bcache_writeback(buf) < 0)
+            ret = -1;
+        else
+            written += sectors;
+    }
+
+    if (written && virtio_blk_flush(blk) < 0)
+        ret = -1;
+    return ret < 0 ? ret : written;
+}
@@ -0,0 +1,177 @@
+#include "kernel.h"
+#include "virtio.h"
+
+#ifdef CONFIG_BENCH
+
+#define BENCH_SWITCHES 10000    // Address space switches per measurement
+#define BENCH_TOUCH_PAGES 16    // User pages touched after each switch (the TLB working set)
+
+/**
+ * Builds an address space like create_process() does, with BENCH_TOUCH_PAGES user pages mapped at USER_BASE.
+ */
+static uint32_t* bench_address_space(void) {
+    uint32_t* page_table = (uint32_t*)alloc_page(&page_list, 1);
+    map_kernel(page_table);
+    for (int i = 0; i < BENCH_TOUCH_PAGES; i++)
+        map_page(page_table, USER_BASE + i * PAGE_SIZE, alloc_page(&page_list, 1), PAGE_U | PAGE_R | PAGE_W);
+    return page_table;
+}
+
+static void bench_free_address_space(uint32_t* page_table) {
+    uint32_t* table0 = (uint32_t*)((page_table[(USER_BASE >> 22) & 0x3ff] >> 10) * PAGE_SIZE);
+    for (int i = 0; i < BENCH_TOUCH_PAGES; i++)
+        free_page(&page_list, (table0[((USER_BASE >> 12) & 0x3ff) + i] >> 10) * PAGE_SIZE, 1);
+    free_page(&page_list, (paddr_t)table0, 1);
+    free_page(&page_list, (paddr_t)page_table, 1);
+}
+
+/**
+ * Alternates between two address spaces and touches the user working set after every switch.
+ *
+ * @param flush Whether to flush the whole TLB around every switch, as the kernel did before ASIDs.
+ * @return The average number of cycles per switch.
+ */
+static uint32_t bench_switch(uint32_t satp_a, uint32_t satp_b, bool flush) {
+    const uint32_t start = READ_CSR(cycle);
+    for (int i = 0; i < BENCH_SWITCHES; i++) {
+        const uint32_t satp = (i & 1) ? satp_b : satp_a;
+        if (flush)
+            __asm__ __volatile__("sfence.vma\n"
+                                 "csrw satp, %0\n"
+                                 "sfence.vma\n" ::"r"(satp));
+        else
+            __asm__ __volatile__("csrw satp, %0\n" ::"r"(satp));
+
+        for (int p = 0; p < BENCH_TOUCH_PAGES; p++)
+            (void)*(volatile uint32_t*)(USER_BASE + p * PAGE_SIZE);
+    }
+    return (READ_CSR(cycle) - start) / BENCH_SWITCHES;
+}
+
+/**
+ * Measures the cost of an address space switch with a full TLB flush against an ASID-tagged switch.
+ */
+static void bench_context_switch(void) {
+    const uint32_t saved_satp = READ_CSR(satp);
+    uint32_t* table_a = bench_address_space();
+    uint32_t* table_b = bench_address_space();
+    const uint32_t satp_a = SATP_SV32 | ((uint32_t)table_a / PAGE_SIZE);
+    const uint32_t satp_b = SATP_SV32 | ((uint32_t)table_b / PAGE_SIZE);
+
+    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SUM);
+    printf("bench: switch with full flush: %d cycles\n", bench_switch(satp_a, satp_b, true));
+    if (asid_max >= 2) {
+        // Use the two highest ASIDs; the TLB is flushed afterwards so they are clean for the scheduler
+        const uint32_t asid_a = asid_max << SATP_ASID_SHIFT;
+        const uint32_t asid_b = (asid_max - 1) << SATP_ASID_SHIFT;
+        printf("bench: switch with ASIDs:      %d cycles\n", bench_switch(satp_a | asid_a, satp_b | asid_b, false));
+    } else {
+        printf("bench: ASIDs not supported\n");
+    }
+    WRITE_CSR(sstatus, READ_CSR(sstatus) & ~SSTATUS_SUM);
+
+    WRITE_CSR(satp, saved_satp);
+    __asm__ __volatile__("sfence.vma");
+    bench_free_address_space(table_a);
+    bench_free_address_space(table_b);
+}
+
+#define BENCH_DISK_SECTORS 64  // Sectors read per pass (capped by the disk capacity)
+#define BENCH_DISK_PASSES 16   // Passes over the sectors per measurement
+
+/**
+ * Converts a byte count and a duration in timer ticks to KB/s.
+ */
+static uint32_t bench_kb_per_sec(uint32_t bytes, uint32_t ticks) {
+    if (!ticks)
+        ticks = 1;
+    return (uint32_t)((uint64_t)bytes * TIMER_FREQ / 1024 / ticks);
+}
+
+/**
+ * Measures sequential read throughput with one single-sector request at a time (the old driver) against one
+ * multi-sector request per pass.
+ */
+static void bench_disk_read(void) {
+    unsigned sectors = blk_devs[0].capacity / SECTOR_SIZE;
+    if (sectors > BENCH_DISK_SECTORS)
+        sectors = BENCH_DISK_SECTORS;
+    if (!sectors)
+        return;
+    const size_t pages = align_up(sectors * SECTOR_SIZE, PAGE_SIZE) / PAGE_SIZE;
+    uint8_t* buf = (uint8_t*)alloc_page(&page_list, pages);
+    const uint32_t bytes = sectors * SECTOR_SIZE * BENCH_DISK_PASSES;
+
+    uint32_t start = READ_CSR(time);
+    for (int pass = 0; pass < BENCH_DISK_PASSES; pass++) {
+        for (unsigned sector = 0; sector < sectors; sector++)
+            read_write_disk(&blk_devs[0], buf + sector * SECTOR_SIZE, sector, false);
+    }
+    printf("bench: disk read, per-sector requests:  %d KB/s\n", bench_kb_per_sec(bytes, READ_CSR(time) - start));
+
+    start = READ_CSR(time);
+    for (int pass = 0; pass < BENCH_DISK_PASSES; pass++)
+        read_write_disk_sectors(&blk_devs[0], buf, 0, sectors, false);
+    printf("bench: disk read, multi-sector request: %d KB/s\n", bench_kb_per_sec(bytes, READ_CSR(time) - start));
+
+    free_page(&page_list, (paddr_t)buf, pages);
+}
+
+#define BENCH_MEM_BYTES (256 * 1024)  // Bytes processed per measurement
+
+/**
+ * Prints a memory routine throughput in bytes per cycle, with two decimals.
+ */
+static void bench_mem_report(const char* name, size_t size, int dst_off, int src_off, uint32_t cycles) {
+    const uint32_t rate = (uint64_t)BENCH_MEM_BYTES * 100 / (cycles ? cycles : 1);
+    printf("bench: %s %d bytes (dst+%d, src+%d): %d.%d%d bytes/cycle\n", name, size, dst_off, src_off, rate / 100,
+           rate / 10 % 10, rate % 10);
+}
+
+/**
+ * Measures memcpy(), memset() and strlen() throughput at various sizes and alignments.
+ */
+static void bench_mem(void) {
+    static const size_t sizes[] = {16, 64, 256, 4096};
+    static const int offsets[][2] = {{0, 0}, {1, 1}, {0, 3}};  // Destination and source misalignment
+    uint8_t* dst = (uint8_t*)alloc_page(&page_list, 2);
+    uint8_t* src = (uint8_t*)alloc_page(&page_list, 2);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        const size_t size = sizes[i];
+        for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+            const uint32_t start = READ_CSR(cycle);
+            for (size_t done = 0; done < BENCH_MEM_BYTES; done += size)
+                memcpy(dst + offsets[j][0], src + offsets[j][1], size);
+            bench_mem_report("memcpy", size, offsets[j][0], offsets[j][1], READ_CSR(cycle) - start);
+        }
+
+        uint32_t start = READ_CSR(cycle);
+        for (size_t done = 0; done < BENCH_MEM_BYTES; done += size)
+            memset(dst, 0, size);
+        bench_mem_report("memset", size, 0, 0, READ_CSR(cycle) - start);
+
+        memset(src, 'x', size - 1);
+        src[size - 1] = '\0';
+        start = READ_CSR(cycle);
+        for (size_t done = 0; done < BENCH_MEM_BYTES; done += size)
+            (void)strlen((const char*)src);
+        bench_mem_report("strlen", size, 0, 0, READ_CSR(cycle) - start);
+    }
+
+    free_page(&page_list, (paddr_t)dst, 2);
+    free_page(&page_list, (paddr_t)src, 2);
+}
+
+/**
+ * Runs the kernel microbenchmarks. Built only with `make BENCH=1`.
+ */
+void bench_run(void) {
+    printf("Benchmarks start ----------------\n");
+    bench_context_switch();
+    bench_disk_read();
+    bench_mem();
+    printf("Benchmarks end ----------------\n");
+}
+
+#endif
@@ -76,6 +76,152 @@ void printf(const char* fmt, ...) {
     va_end(vargs);
 }
 
+// Word accessed by the memory routines; may_alias lets it read and write memory of any type. Only aligned words are
+// accessed, since misaligned accesses trap to the firmware on RISC-V.
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_ONES 0x01010101u   // 0x01 in every byte
+#define WORD_HIGHS 0x80808080u  // 0x80 in every byte
+
+// These routines are written with explicit loops so that the compiler, with -ffreestanding, has no library to
+// turn them back into calls to themselves.
+
+#ifdef CONFIG_VECTOR
+// vector_enabled is set once the vector unit is known to be usable: by vector_init() in the kernel, and from
+// SYS_HWCAP in user programs. Until then the scalar routines are used.
+bool vector_enabled;
+
+// The vector variants below are inline assembly that enables the vector extension locally, so that the compiler
+// itself never emits vector instructions and the same binary runs on harts without the unit. They use register group
+// v8 (and v16), with LMUL=8 to move as many bytes per instruction as possible; v0 and v1 hold masks.
+
+static void* memcpy_rvv(void* dst, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    size_t vl;
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "1:\n"
+        "vsetvli %[vl], %[n], e8, m8, ta, ma\n"
+        "vle8.v v8, (%[s])\n"
+        "vse8.v v8, (%[d])\n"
+        "sub %[n], %[n], %[vl]\n"
+        "add %[s], %[s], %[vl]\n"
+        "add %[d], %[d], %[vl]\n"
+        "bnez %[n], 1b\n"
+        ".option pop\n"
+        : [vl] "=&r"(vl), [n] "+r"(n), [s] "+r"(s), [d] "+r"(d)
+        :
+        : "memory");
+    return dst;
+}
+
+static void* memset_rvv(void* buf, char c, size_t n) {
+    uint8_t* p = (uint8_t*)buf;
+    size_t vl;
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "vsetvli %[vl], %[n], e8, m8, ta, ma\n"
+        "vmv.v.x v8, %[c]\n"
+        "1:\n"
+        "vsetvli %[vl], %[n], e8, m8, ta, ma\n"
+        "vse8.v v8, (%[p])\n"
+        "sub %[n], %[n], %[vl]\n"
+        "add %[p], %[p], %[vl]\n"
+        "bnez %[n], 1b\n"
+        ".option pop\n"
+        : [vl] "=&r"(vl), [n] "+r"(n), [p] "+r"(p)
+        : [c] "r"(c)
+        : "memory");
+    return buf;
+}
+
+static int memcmp_rvv(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    size_t vl;
+    long idx;  // Index of the first difference in the last chunk, or -1
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "1:\n"
+        "vsetvli %[vl], %[n], e8, m8, ta, ma\n"
+        "vle8.v v8, (%[a])\n"
+        "vle8.v v16, (%[b])\n"
+        "vmsne.vv v0, v8, v16\n"
+        "vfirst.m %[idx], v0\n"
+        "bgez %[idx], 2f\n"
+        "sub %[n], %[n], %[vl]\n"
+        "add %[a], %[a], %[vl]\n"
+        "add %[b], %[b], %[vl]\n"
+        "bnez %[n], 1b\n"
+        "2:\n"
+        ".option pop\n"
+        : [vl] "=&r"(vl), [idx] "=&r"(idx), [n] "+r"(n), [a] "+r"(a), [b] "+r"(b)
+        :
+        : "memory");
+    return idx < 0 ? 0 : a[idx] - b[idx];
+}
+
+static int strlen_rvv(const char* s) {
+    const char* p = s;
+    size_t vl;
+    long idx;  // Index of the null character in the last chunk, or -1
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "1:\n"
+        "vsetvli %[vl], %[max], e8, m8, ta, ma\n"
+        // Fault-only-first: the load stops short of an unmapped page instead of trapping
+        "vle8ff.v v8, (%[p])\n"
+        "csrr %[vl], vl\n"
+        "vmseq.vi v0, v8, 0\n"
+        "vfirst.m %[idx], v0\n"
+        "bgez %[idx], 2f\n"
+        "add %[p], %[p], %[vl]\n"
+        "j 1b\n"
+        "2:\n"
+        ".option pop\n"
+        : [vl] "=&r"(vl), [idx] "=&r"(idx), [p] "+r"(p)
+        : [max] "r"(-1)
+        : "memory");
+    return p + idx - s;
+}
+
+static int strcmp_rvv(const char* s1, const char* s2) {
+    const char* a = s1;
+    const char* b = s2;
+    size_t vl;
+    long idx;  // Index of the first difference or null character in the last chunk, or -1
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "1:\n"
+        "vsetvli %[vl], %[max], e8, m8, ta, ma\n"
+        // Both loads are fault-only-first; the second one runs with the length the first one reached
+        "vle8ff.v v8, (%[a])\n"
+        "vle8ff.v v16, (%[b])\n"
+        "csrr %[vl], vl\n"
+        "vmseq.vi v0, v8, 0\n"
+        "vmsne.vv v1, v8, v16\n"
+        "vmor.mm v0, v0, v1\n"
+        "vfirst.m %[idx], v0\n"
+        "bgez %[idx], 2f\n"
+        "add %[a], %[a], %[vl]\n"
+        "add %[b], %[b], %[vl]\n"
+        "j 1b\n"
+        "2:\n"
+        ".option pop\n"
+        : [vl] "=&r"(vl), [idx] "=&r"(idx), [a] "+r"(a), [b] "+r"(b)
+        : [max] "r"(-1)
+        : "memory");
+    return a[idx] - b[idx];
+}
+#endif
+
 /**
  * Sets the first 'n' bytes of the memory area pointed to by 'buf' to the specified value 'c'.
  *
@@ -87,18 +233,47 @@ void printf(const char* fmt, ...) {
  * @return A pointer to the memory area 'buf'.
  */
 void* memset(void* buf, char c, size_t n) {
+#ifdef CONFIG_VECTOR
+    if (vector_enabled && n >= VECTOR_MIN_BYTES)
+        return memset_rvv(buf, c, n);
+#endif
     uint8_t* p = (uint8_t*)buf;
 
-    // Loop to write the value 'c' to 'n' bytes in memory
+    // Head: bytes up to a word boundary
+    while (n && !is_aligned(p, WORD_SIZE)) {
+        *p++ = c;
+        n--;
+    }
+
+    // Body: the byte replicated in a word, eight words per iteration, then single words
+    const uint32_t w = (uint8_t)c * WORD_ONES;
+    word_t* wp = (word_t*)p;
+    for (; n >= 8 * WORD_SIZE; n -= 8 * WORD_SIZE, wp += 8) {
+        wp[0] = w;
+        wp[1] = w;
+        wp[2] = w;
+        wp[3] = w;
+        wp[4] = w;
+        wp[5] = w;
+        wp[6] = w;
+        wp[7] = w;
+    }
+    for (; n >= WORD_SIZE; n -= WORD_SIZE)
+        *wp++ = w;
+
+    // Tail
+    p = (uint8_t*)wp;
     while (n--)
-        *p++ = c;  // Write 'c' to the current address and increment it by 1
-    // Return the original memory address
+        *p++ = c;
     return buf;
 }
 
 /**
  * Copies n bytes from memory area src to memory area dst.
  *
+ * The destination is aligned first. If the source then is aligned too, whole words are copied, eight per iteration;
+ * otherwise every destination word is assembled from the two aligned source words it straddles.
+ *
  * @param dst Pointer to the destination array where the content is to be copied.
  * @param src Pointer to the source of data to be copied.
  * @param n Number of bytes to copy.
@@ -106,13 +281,126 @@ void* memset(void* buf, char c, size_t n) {
  * @return A pointer to the destination array, which is dst.
  */
 void* memcpy(void* dst, const void* src, size_t n) {
+#ifdef CONFIG_VECTOR
+    if (vector_enabled && n >= VECTOR_MIN_BYTES)
+        return memcpy_rvv(dst, src, n);
+#endif
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+
+    // Head: bytes up to a word boundary of the destination
+    while (n && !is_aligned(d, WORD_SIZE)) {
+        *d++ = *s++;
+        n--;
+    }
+
+    word_t* dw = (word_t*)d;
+    if (is_aligned(s, WORD_SIZE)) {
+        const word_t* sw = (const word_t*)s;
+        for (; n >= 8 * WORD_SIZE; n -= 8 * WORD_SIZE, dw += 8, sw += 8) {
+            const uint32_t w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+            const uint32_t w4 = sw[4], w5 = sw[5], w6 = sw[6], w7 = sw[7];
+            dw[0] = w0;
+            dw[1] = w1;
+            dw[2] = w2;
+            dw[3] = w3;
+            dw[4] = w4;
+            dw[5] = w5;
+            dw[6] = w6;
+            dw[7] = w7;
+        }
+        for (; n >= WORD_SIZE; n -= WORD_SIZE)
+            *dw++ = *sw++;
+        s = (const uint8_t*)sw;
+    } else if (n >= WORD_SIZE) {
+        // The aligned source words may extend past the source buffer, but never past its page
+        const unsigned shift = ((uint32_t)s % WORD_SIZE) * 8;
+        const word_t* sw = (const word_t*)align_down(s, WORD_SIZE);
+        uint32_t lo = *sw++;
+        for (; n >= WORD_SIZE; n -= WORD_SIZE, s += WORD_SIZE) {
+            const uint32_t hi = *sw++;
+            *dw++ = (lo >> shift) | (hi << (32 - shift));
+            lo = hi;
+        }
+    }
+
+    // Tail
+    d = (uint8_t*)dw;
+    while (n--)
+        *d++ = *s++;
+    return dst;
+}
+
+/**
+ * Copies n bytes from memory area src to memory area dst. The areas may overlap.
+ *
+ * @param dst Pointer to the destination array where the content is to be copied.
+ * @param src Pointer to the source of data to be copied.
+ * @param n Number of bytes to copy.
+ *
+ * @return A pointer to the destination array, which is dst.
+ */
+void* memmove(void* dst, const void* src, size_t n) {
     uint8_t* d = (uint8_t*)dst;
     const uint8_t* s = (const uint8_t*)src;
+
+    // A forward copy only overwrites source bytes it has already read when dst is below src
+    if (d <= s || d >= s + n)
+        return memcpy(dst, src, n);
+
+    // Backward copy: tail bytes down to a word boundary, whole words if the source is aligned too, then the head
+    d += n;
+    s += n;
+    while (n && !is_aligned(d, WORD_SIZE)) {
+        *--d = *--s;
+        n--;
+    }
+    if (is_aligned(s, WORD_SIZE)) {
+        word_t* dw = (word_t*)d;
+        const word_t* sw = (const word_t*)s;
+        for (; n >= WORD_SIZE; n -= WORD_SIZE)
+            *--dw = *--sw;
+        d = (uint8_t*)dw;
+        s = (const uint8_t*)sw;
+    }
     while (n--)
-        *d++ = *s++;  // Copy the current byte and increment the pointers
+        *--d = *--s;
     return dst;
 }
 
+/**
+ * Compares the first n bytes of two memory areas.
+ *
+ * @param s1 The first memory area.
+ * @param s2 The second memory area.
+ * @param n Number of bytes to compare.
+ *
+ * @return The difference between the first differing bytes (as unsigned char), or zero if the areas match.
+ */
+int memcmp(const void* s1, const void* s2, size_t n) {
+#ifdef CONFIG_VECTOR
+    if (vector_enabled && n >= VECTOR_MIN_BYTES)
+        return memcmp_rvv(s1, s2, n);
+#endif
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+
+    // Skip equal words while both areas are aligned
+    if (is_aligned(a, WORD_SIZE) && is_aligned(b, WORD_SIZE)) {
+        while (n >= WORD_SIZE && *(const word_t*)a == *(const word_t*)b) {
+            a += WORD_SIZE;
+            b += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
+    for (; n; n--, a++, b++) {
+        if (*a != *b)
+            return *a - *b;
+    }
+    return 0;
+}
+
 /**
  * Copies the string pointed to by src, including the null character, to the buffer pointed to by dst.
  *
@@ -137,6 +425,10 @@ char* strcpy(char* dst, const char* src) {
  * or be greater than s2.
  */
 int strcmp(const char* s1, const char* s2) {
+#ifdef CONFIG_VECTOR
+    if (vector_enabled)
+        return strcmp_rvv(s1, s2);
+#endif
     while (*s1 && *s2) {
         if (*s1 != *s2)
             break;
@@ -159,9 +451,32 @@ int strncmp(const char* s1, const char* s2, size_t n) {
     return *s1 - *s2;
 }
 
+/**
+ * Returns the length of a string. After the first word boundary, it checks a word at a time for a zero byte; aligned
+ * words never cross a page boundary, so reading past the terminator is safe.
+ *
+ * @param s The string.
+ * @return The number of characters before the null character.
+ */
 int strlen(const char* s) {
-    int len = 0;
-    while (*s++)
-        len++;
-    return len;
+#ifdef CONFIG_VECTOR
+    if (vector_enabled)
+        return strlen_rvv(s);
+#endif
+    const char* p = s;
+    while (!is_aligned(p, WORD_SIZE)) {
+        if (!*p)
+            return p - s;
+        p++;
+    }
+
+    // A word has a zero byte if subtracting 1 from every byte borrows into a byte whose high bit was clear
+    const word_t* wp = (const word_t*)p;
+    while (!((*wp - WORD_ONES) & ~*wp & WORD_HIGHS))
+        wp++;
+
+    p = (const char*)wp;
+    while (*p)
+        p++;
+    return p - s;
 }
\ No newline at end of file
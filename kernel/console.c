@@ -0,0 +1,131 @@
+#include "kernel.h"
+#include "virtio.h"
+#include "uart.h"
+
+// Kernel console output is collected in a ring buffer and written with one SBI Debug Console call per line (or per
+// full buffer) instead of one legacy SBI call per character. With `make CONSOLE=uart` the kernel drives the 16550 UART
+// directly instead. A virtio-console, when present, takes precedence and does its own buffering.
+char console_buf[CONSOLE_BUF_SIZE];
+unsigned console_head;  // Next byte to write out
+unsigned console_tail;  // Next free slot
+// console_dbcn tells whether the SBI Debug Console extension is available: -1 until probed, then 0 or 1.
+int console_dbcn = -1;
+// console_synchronous is set by PANIC: from then on every character is written immediately.
+bool console_synchronous;
+
+/**
+ * Writes bytes to the SBI console, with the Debug Console extension if the firmware has it.
+ *
+ * @param buf The bytes, in kernel (identity mapped) memory.
+ * @param len The number of bytes.
+ */
+static void sbi_console_write(const char* buf, size_t len) {
+    if (console_dbcn < 0)
+        console_dbcn = sbi_call(SBI_EXT_DBCN, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXTENSION, SBI_EXT_BASE).value != 0;
+
+    while (len > 0 && console_dbcn) {
+        // The firmware may write fewer bytes than requested
+        const struct sbiret ret = sbi_call(len, (paddr_t)buf, 0, 0, 0, 0, SBI_DBCN_WRITE, SBI_EXT_DBCN);
+        if (ret.error)
+            break;
+        buf += ret.value;
+        len -= ret.value;
+    }
+
+    for (size_t i = 0; i < len; i++)
+        sbi_call(buf[i], 0, 0, 0, 0, 0, 0, SBI_EXT_LEGACY_PUTCHAR);
+}
+
+/**
+ * Sets up the console device selected at build time.
+ */
+void console_init(void) {
+#ifdef CONFIG_UART_CONSOLE
+    uart_init();
+#endif
+}
+
+/**
+ * Writes out the buffered console output.
+ */
+void console_flush(void) {
+#ifdef CONFIG_UART_CONSOLE
+    uart_tx_start();
+#endif
+    while (console_head != console_tail) {
+        // Write the contiguous part up to the tail or the end of the buffer
+        const unsigned head = console_head % CONSOLE_BUF_SIZE;
+        const unsigned tail = console_tail % CONSOLE_BUF_SIZE;
+        const unsigned len = head < tail ? tail - head : CONSOLE_BUF_SIZE - head;
+        sbi_console_write(&console_buf[head], len);
+        console_head += len;
+    }
+    virtio_console_flush();
+}
+
+/**
+ * Switches the console to synchronous output for PANIC: the buffered output is written out first, then every character
+ * goes straight to the firmware, so that the message appears even if the kernel never flushes again.
+ */
+void console_sync(void) {
+    console_synchronous = true;
+    console_flush();
+}
+
+/**
+ * Writes a character to the console. Output is buffered until a newline or a full buffer; the kernel also flushes
+ * before it waits or switches processes.
+ *
+ * @param ch The character to write.
+ */
+void putchar(char ch) {
+    if (console_synchronous) {
+#ifdef CONFIG_UART_CONSOLE
+        uart_putchar_sync(ch);
+#else
+        sbi_call(ch, 0, 0, 0, 0, 0, 0, SBI_EXT_LEGACY_PUTCHAR);
+#endif
+        return;
+    }
+
+    if (virtio_console_putchar(ch))
+        return;
+
+#ifdef CONFIG_UART_CONSOLE
+    uart_putchar(ch);
+#else
+    console_buf[console_tail % CONSOLE_BUF_SIZE] = ch;
+    console_tail++;
+    if (ch == '\n' || console_tail - console_head == CONSOLE_BUF_SIZE)
+        console_flush();
+#endif
+}
+
+/**
+ * Writes a buffer to the console.
+ *
+ * @param buf The bytes to write.
+ * @param len The number of bytes.
+ */
+void console_write(const char* buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        putchar(buf[i]);
+}
+
+/**
+ * Reads a character from the console without blocking.
+ *
+ * @return The character, or -1 if there is no pending input.
+ */
+long getchar(void) {
+    const long ch = virtio_console_getchar();
+    if (ch >= 0)
+        return ch;
+
+#ifdef CONFIG_UART_CONSOLE
+    return uart_getchar();
+#else
+    const struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, SBI_EXT_LEGACY_GETCHAR);
+    return ret.error;
+#endif
+}
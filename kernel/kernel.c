@@ -2,6 +2,9 @@
 #include "common.h"
 #include "virtio.h"
 #include "tarfs.h"
+#include "bcache.h"
+#include "vm.h"
+#include "plic.h"
 
 typedef unsigned char uint8_t;
 typedef unsigned int uint32_t;
@@ -14,17 +17,34 @@ extern char __kernel_base[];
 // Use names from `llvm-nm build/shell.bin.o` command
 extern char _binary_build_shell_bin_start[], _binary_build_shell_bin_size[];
 
-struct process procs[PROCS_MAX];
+_Static_assert(sizeof(struct process) <= PAGE_SIZE, "struct process must fit in a page");
+
+int next_pid = 1;              // Process ID of the next created process
+struct process* zombies;       // Exited processes waiting to be freed, linked through rq_next
 struct process* current_proc;  // Pointer to the currently running process
 struct process* idle_proc;     // Pointer to the idle process
+struct run_queue run_queue;    // Runnable processes, except the running one and the idle process
+struct wait_queue console_wq;  // Processes waiting for console input
+
+// ASID 0 belongs to the idle process; the others are handed out per generation and recycled by starting a new
+// generation (with a full TLB flush) when they run out.
+uint32_t asid_max;             // Largest ASID implemented by the hart, 0 if ASIDs are not supported
+uint32_t asid_generation = 1;  // Current ASID generation
+uint32_t asid_next = 1;        // Next ASID to hand out in the current generation
 
 // Kernel entry point function
 void kernel_main(void) {
+    const uint32_t t_boot = READ_CSR(time);
     memset(__bss, 0, (size_t)__bss_end - (size_t)__bss);
     WRITE_CSR(stvec, (uint32_t)kernel_entry);
+    const uint32_t t_bss = READ_CSR(time);
 
     // Initialize the free list
     init_free_list(&page_list);
+    const uint32_t t_pages = READ_CSR(time);
+#ifdef CONFIG_VECTOR
+    vector_init();
+#endif
 
     // Test allocator by allocating and freeing a page fragmented
     printf("Testing start ----------------\n");
@@ -36,33 +56,88 @@ void kernel_main(void) {
     printf("paddr1: %x\n", paddr1);
     printf("paddr2: %x\n", paddr2);
 
-    free_page(&page_list, paddr1);
+    free_page(&page_list, paddr1, 1);
 
     paddr_t paddr3 = alloc_page(&page_list, 1);
     printf("paddr3: %x\n", paddr3);
 
-    free_page(&page_list, paddr0);
-    free_page(&page_list, paddr2);
-    free_page(&page_list, paddr3);
+    free_page(&page_list, paddr0, 1);
+    free_page(&page_list, paddr2, 1);
+    free_page(&page_list, paddr3, 1);
 
     paddr_t paddr4 = alloc_page(&page_list, 1);
     printf("paddr4: %x\n", paddr4);
 
-    free_page(&page_list, paddr4);
+    free_page(&page_list, paddr4, 1);
+
+    // Multi-page blocks are contiguous and coalesce back with their buddies when freed
+    paddr_t paddr5 = alloc_page(&page_list, 3);
+    paddr_t paddr6 = alloc_page(&page_list, 4);
+    printf("paddr5: %x (3 pages)\n", paddr5);
+    printf("paddr6: %x (4 pages)\n", paddr6);
+    free_page(&page_list, paddr5, 3);
+    free_page(&page_list, paddr6, 4);
 
     printf("Testing end ----------------\n");
 
-    virtio_blk_init();
+    const uint32_t t_virtio = READ_CSR(time);
+    plic_init();
+    console_init();
+    virtio_init();
+    bcache_init();
+    const uint32_t t_fs = READ_CSR(time);
     fs_init();
+    const uint32_t t_done = READ_CSR(time);
+
+    // Boot phase timings, converted from timer ticks to microseconds
+    const uint32_t ticks_per_us = TIMER_FREQ / 1000000;
+    printf("boot: bss %d us, page pool %d us, virtio %d us, fs %d us\n", (t_bss - t_boot) / ticks_per_us,
+           (t_pages - t_bss) / ticks_per_us, (t_fs - t_virtio) / ticks_per_us, (t_done - t_fs) / ticks_per_us);
 
     idle_proc = create_process(NULL, 0);
     idle_proc->pid = -1;  // idle
     current_proc = idle_proc;
+    asid_init();
+
+#ifdef CONFIG_BENCH
+    bench_run();
+#endif
 
     create_process(_binary_build_shell_bin_start, (size_t)_binary_build_shell_bin_size);
+    timer_init();
+
+    // From here on kernel_main is the idle process: it is only switched to when the run queue is empty. It waits for an
+    // interrupt with wfi, which wakes up on a pending interrupt even though the kernel keeps sstatus.SIE clear, and
+    // handles it directly instead of trapping.
+    while (1) {
+        console_flush();
+        __asm__ __volatile__("wfi");
+        if (READ_CSR(sip) & SIP_STIP)
+            timer_tick();
+        if (READ_CSR(sip) & SIP_SEIP)
+            plic_handle();
+        yield();
+    }
+}
 
-    yield();
-    PANIC("switched to idle\n");
+/**
+ * Identity maps the kernel and the MMIO devices into a first level page table using 4MB megapages. This costs a handful
+ * of entry writes per process and shares no second level tables, instead of mapping every 4KB kernel page.
+ *
+ * @param page_table The first level page table of the process.
+ */
+void map_kernel(uint32_t* page_table) {
+    // The kernel image and free RAM; the first megapage also covers the firmware below __kernel_base, which the
+    // firmware keeps protected with PMP. Kernel mappings are global so their TLB entries survive address space switches.
+    for (paddr_t paddr = align_down((paddr_t)__kernel_base, MEGAPAGE_SIZE); paddr < (paddr_t)__free_ram_end; paddr += MEGAPAGE_SIZE)
+        map_megapage(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+
+    // The virtio-mmio slots
+    const paddr_t mmio = align_down(VIRTIO_MMIO_BASE, MEGAPAGE_SIZE);
+    map_megapage(page_table, mmio, mmio, PAGE_R | PAGE_W | PAGE_G);
+
+    // PLIC (the priority, enable and S-mode context registers all sit in its first megapage)
+    map_megapage(page_table, PLIC_BASE, PLIC_BASE, PAGE_R | PAGE_W | PAGE_G);
 }
 
 /**
@@ -73,26 +148,17 @@ void kernel_main(void) {
  *
  * @return A pointer to the newly created process structure.
  *
- * @details This function finds a free process slot, loads the stack with call destination save registers so that switch_context()
- * can return, maps the kernel memory, maps the user memory, initializes the process structure and returns a pointer to the newly
- * created process structure.
+ * @details This function allocates the process structure and its kernel stack from the page allocator, loads the stack with
+ * call destination save registers so that switch_context() can return, maps the kernel memory, sets up the user memory, initializes
+ * the process structure and returns a pointer to the newly created process structure. There is no limit on the number of
+ * processes other than free memory; destroy_process() gives everything back.
  */
 struct process* create_process(const void* image, size_t image_size) {
-    // Find a free process slot
-    struct process* proc = NULL;
-    int i;
-    for (i = 0; i < PROCS_MAX; i++) {
-        if (procs[i].state == PROC_UNUSED) {
-            proc = &procs[i];
-            break;
-        }
-    }
-
-    if (!proc)
-        PANIC("no free process slots");
+    struct process* proc = (struct process*)alloc_page(&page_list, 1);
+    proc->stack = (uint8_t*)alloc_page(&page_list, KERNEL_STACK_SIZE / PAGE_SIZE);
 
     // load the stack with call destination save registers so that switch_context() can return
-    uint32_t* sp = (uint32_t*)&proc->stack[sizeof(proc->stack)];
+    uint32_t* sp = (uint32_t*)(proc->stack + KERNEL_STACK_SIZE);
     *--sp = 0;                     // s11
     *--sp = 0;                     // s10
     *--sp = 0;                     // s9
@@ -108,36 +174,126 @@ struct process* create_process(const void* image, size_t image_size) {
     *--sp = (uint32_t)user_entry;  // ra
 
     uint32_t* page_table = (uint32_t*)alloc_page(&page_list, 1);
+    map_kernel(page_table);
 
-    // Map the kernel memory
-    for (paddr_t paddr = (paddr_t)__kernel_base; paddr < (paddr_t)__free_ram_end; paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-
-    // VirtIO-blk
-    map_page(page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W);
-
-    // Map the user memory
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        const paddr_t page = alloc_page(&page_list, 1);
-        memcpy((void*)page, image + off, PAGE_SIZE);
-        map_page(page_table, USER_BASE + off, page, PAGE_U | PAGE_R | PAGE_W | PAGE_X);  // PAGE_U: user mode accessible
-    }
+    // The user memory is mapped page by page as the program touches it
+    if (image)
+        vm_map_image(proc, image, image_size);
+#ifdef CONFIG_VECTOR
+    if (image && !vector_alloc(proc))
+        PANIC("out of memory");
+#endif
 
     // Initialize the process structure
-    proc->pid = i + 1;
+    proc->pid = next_pid++;
     proc->state = PROC_RUNNABLE;
     proc->sp = (uint32_t)sp;
     proc->page_table = page_table;
+    proc->priority = PRIO_DEFAULT;
+
+    // A process without an image is the idle process, which never goes on the run queue
+    if (image)
+        runqueue_push(proc);
     return proc;
 }
 
 /**
- * Writes a character to the console.
+ * Creates a copy of the current process, which is in a system call: the child shares the parent's pages copy-on-write,
+ * gets copies of its regions and file descriptors, and returns 0 from the same system call.
+ *
+ * Unlike create_process(), this fails instead of panicking when memory runs out, since any process can call fork().
  *
- * @param ch The character to write.
+ * @param f The trap frame of the system call.
+ * @param user_pc The address of the ecall instruction.
+ * @return The child process, already on the run queue, or NULL if there is not enough memory.
  */
-void putchar(char ch) {
-    sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* Console Putchar */);
+struct process* fork_process(struct trap_frame* f, uint32_t user_pc) {
+    struct process* proc = (struct process*)try_alloc_page(&page_list, 1);
+    if (!proc)
+        return NULL;
+    proc->stack = (uint8_t*)try_alloc_page(&page_list, KERNEL_STACK_SIZE / PAGE_SIZE);
+    if (!proc->stack) {
+        free_page(&page_list, (paddr_t)proc, 1);
+        return NULL;
+    }
+    proc->page_table = (uint32_t*)try_alloc_page(&page_list, 1);
+    if (!proc->page_table) {
+        free_page(&page_list, (paddr_t)proc->stack, KERNEL_STACK_SIZE / PAGE_SIZE);
+        free_page(&page_list, (paddr_t)proc, 1);
+        return NULL;
+    }
+    map_kernel(proc->page_table);
+
+    // From here on destroy_process() undoes a partial copy: it drops the references to the shared pages, whose parent
+    // entries are left copy-on-write
+    bool copied = vm_fork(proc);
+#ifdef CONFIG_VECTOR
+    copied = copied && vector_fork(proc);
+#endif
+    if (!copied) {
+        destroy_process(proc);
+        return NULL;
+    }
+    memcpy(proc->fds, current_proc->fds, sizeof(proc->fds));
+
+    // The trap frame goes at the top of the kernel stack, where kernel_entry would have saved it, and switch_context()
+    // returns to fork_entry() which restores it
+    uint32_t* sp = (uint32_t*)(proc->stack + KERNEL_STACK_SIZE);
+    sp -= sizeof(struct trap_frame) / sizeof(uint32_t);
+    struct trap_frame* child_frame = (struct trap_frame*)sp;
+    *child_frame = *f;
+    child_frame->a0 = 0;
+    for (int i = 0; i < 11; i++)
+        *--sp = 0;                 // s11 to s1
+    *--sp = user_pc + 4;           // s0: skip the ecall instruction
+    *--sp = (uint32_t)fork_entry;  // ra
+
+    proc->pid = next_pid++;
+    proc->state = PROC_RUNNABLE;
+    proc->sp = (uint32_t)sp;
+    proc->priority = current_proc->priority;
+    runqueue_push(proc);
+    return proc;
+}
+
+/**
+ * Frees everything a process owns: its user pages and page tables, its kernel stack and the process structure itself.
+ * The process must not be running, since its kernel stack and address space are released.
+ *
+ * @param proc The exited process.
+ */
+void destroy_process(struct process* proc) {
+#ifdef CONFIG_VECTOR
+    vector_free(proc);
+#endif
+    vm_free(proc);
+    free_page_table(proc->page_table);
+    free_page(&page_list, (paddr_t)proc->stack, KERNEL_STACK_SIZE / PAGE_SIZE);
+    free_page(&page_list, (paddr_t)proc, 1);
+}
+
+/**
+ * Returns the open file behind a descriptor of the current process.
+ *
+ * @param fd The file descriptor.
+ * @return The descriptor entry, or NULL if fd is not an open file (the console descriptors have no entry).
+ */
+static struct fd* fd_get(int fd) {
+    if (fd <= STDERR_FILENO || fd >= FD_MAX || !current_proc->fds[fd].file)
+        return NULL;
+    return &current_proc->fds[fd];
+}
+
+/**
+ * Terminates the current process. It is still running on its kernel stack, so it is freed by the next yield() of
+ * another process.
+ */
+void exit_process(void) {
+    current_proc->state = PROC_EXITED;
+    current_proc->rq_next = zombies;
+    zombies = current_proc;
+    yield();
+    PANIC("unreachable");
 }
 
 /**
@@ -151,6 +307,184 @@ void handle_syscall(struct trap_frame* f) {
         case SYS_PUTCHAR:
             putchar(f->a0);  // a0 contains the character to write
             break;
+        case SYS_HWCAP:
+#ifdef CONFIG_VECTOR
+            f->a0 = vector_enabled ? HWCAP_V : 0;
+#else
+            f->a0 = 0;
+#endif
+            break;
+        case SYS_WRITE: {
+            // a0 contains the file descriptor, a1 the buffer, a2 the length
+            const int fd = f->a0;
+            const char* buf = (const char*)f->a1;
+            const int len = f->a2;
+            if (len < 0 || !vm_access(buf, len, PROT_READ)) {
+                f->a0 = -1;
+                break;
+            }
+
+            if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+                console_write(buf, len);
+                f->a0 = len;
+                break;
+            }
+
+            // Files are written at the descriptor's position, straight from the caller's buffer to the block cache
+            struct fd* file = fd_get(fd);
+            if (!file || (file->flags & O_ACCMODE) == O_RDONLY) {
+                f->a0 = -1;
+                break;
+            }
+            const int written = fs_write(file->file, file->offset, buf, len);
+            if (written > 0)
+                file->offset += written;
+            f->a0 = written;
+            break;
+        }
+        case SYS_READ: {
+            // a0 contains the file descriptor, a1 the buffer, a2 the length
+            const int fd = f->a0;
+            char* buf = (char*)f->a1;
+            int len = f->a2;
+            if (len < 0) {
+                f->a0 = -1;
+                break;
+            }
+
+            // Only the part of the buffer that gets filled is checked, and faulted in
+            if (fd == STDIN_FILENO) {
+                if (len > 0 && !vm_access(buf, 1, PROT_WRITE)) {
+                    f->a0 = -1;
+                    break;
+                }
+
+                // Block until a character arrives, then take the ones already pending
+                int n = 0;
+                while (n < len) {
+                    const long ch = getchar();
+                    if (ch < 0) {
+                        if (n > 0)
+                            break;
+                        sleep_on(&console_wq);
+                        continue;
+                    }
+                    // The next page of the buffer is checked when the first character goes to it
+                    if (is_aligned((vaddr_t)&buf[n], PAGE_SIZE) && !vm_access(&buf[n], 1, PROT_WRITE))
+                        break;
+                    buf[n++] = ch;
+                }
+                f->a0 = n;
+                break;
+            }
+
+            struct fd* file = fd_get(fd);
+            if (!file || (file->flags & O_ACCMODE) == O_WRONLY) {
+                f->a0 = -1;
+                break;
+            }
+            const size_t size = file->file->size;
+            if (file->offset >= size)
+                len = 0;
+            else if ((size_t)len > size - file->offset)
+                len = size - file->offset;
+            if (!vm_access(buf, len, PROT_WRITE)) {
+                f->a0 = -1;
+                break;
+            }
+            const int n = fs_read(file->file, file->offset, buf, len);
+            if (n > 0)
+                file->offset += n;
+            f->a0 = n;
+            break;
+        }
+        case SYS_OPEN: {
+            // a0 contains the filename, a1 the flags
+            const char* filename = (const char*)f->a0;
+            const int flags = f->a1;
+            if (!vm_access_string(filename)) {
+                f->a0 = -1;
+                break;
+            }
+
+            struct file* file = fs_lookup(filename);
+            int fd = STDERR_FILENO + 1;
+            while (fd < FD_MAX && current_proc->fds[fd].file)
+                fd++;
+            if (!file || fd == FD_MAX || (flags & O_ACCMODE) > O_RDWR) {
+                f->a0 = -1;
+                break;
+            }
+
+            if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && fs_truncate(file, 0) < 0) {
+                f->a0 = -1;
+                break;
+            }
+
+            current_proc->fds[fd].file = file;
+            current_proc->fds[fd].offset = 0;
+            current_proc->fds[fd].flags = flags;
+            f->a0 = fd;
+            break;
+        }
+        case SYS_LSEEK: {
+            // a0 contains the file descriptor, a1 the offset, a2 where it is counted from
+            struct fd* file = fd_get(f->a0);
+            const int offset = f->a1;
+            const int whence = f->a2;
+            int base = -1;
+            if (file && whence == SEEK_SET)
+                base = 0;
+            else if (file && whence == SEEK_CUR)
+                base = file->offset;
+            else if (file && whence == SEEK_END)
+                base = file->file->size;
+            // The new position must fit in an int: check before adding, since signed overflow is undefined
+            if (base < 0 || (offset > 0 && offset > 0x7fffffff - base) || base + offset < 0) {
+                f->a0 = -1;
+                break;
+            }
+
+            // Seeking past the end is allowed: a write there fills the gap with zeros
+            file->offset = base + offset;
+            f->a0 = file->offset;
+            break;
+        }
+        case SYS_MMAP: {
+            // a0 contains the file descriptor (-1 for zero-filled memory), a1 the length, a2 the protection
+            const int fd = f->a0;
+            const int len = f->a1;
+            const int prot = f->a2;
+            struct fd* file = fd_get(fd);
+            if (len <= 0 || (fd != -1 && (!file || (file->flags & O_ACCMODE) == O_WRONLY))) {
+                f->a0 = -1;
+                break;
+            }
+
+            // Pages are read from the file when they are first touched
+            const vaddr_t addr = vm_mmap(fd == -1 ? NULL : file->file, len, prot);
+            f->a0 = addr ? addr : (uint32_t)-1;
+            break;
+        }
+        case SYS_MUNMAP:
+            f->a0 = vm_munmap(f->a0);
+            break;
+        case SYS_FORK: {
+            const struct process* child = fork_process(f, READ_CSR(sepc));
+            f->a0 = child ? child->pid : -1;
+            break;
+        }
+        case SYS_CLOSE: {
+            struct fd* file = fd_get(f->a0);
+            if (!file) {
+                f->a0 = -1;
+                break;
+            }
+
+            file->file = NULL;
+            f->a0 = 0;
+            break;
+        }
         case SYS_GETCHAR:
             while (1) {
                 const long ch = getchar();
@@ -159,20 +493,23 @@ void handle_syscall(struct trap_frame* f) {
                     break;
                 }
 
-                yield();  // Yield the CPU to allow other processes to run
+                sleep_on(&console_wq);  // Block until the timer tick or the console interrupt sees pending input
             }
             break;
         case SYS_EXIT:
             printf("process %d exited\n", current_proc->pid);
-            current_proc->state = PROC_EXITED;
-            yield();
-            PANIC("unreachable");
+            exit_process();
         case SYS_READFILE:
         case SYS_WRITEFILE: {
             // a0 contains the filename, a1 contains the buffer, a2 contains the length
             const char* filename = (const char*)f->a0;
             char* buf = (char*)f->a1;
             int len = f->a2;
+            if (!vm_access_string(filename) || len < 0) {
+                f->a0 = -1;
+                break;
+            }
+
             // Look up the file
             struct file* file = fs_lookup(filename);
             if (!file) {
@@ -181,86 +518,324 @@ void handle_syscall(struct trap_frame* f) {
                 break;
             }
 
-            // Truncate the length if it is larger than the file size
-            if (len > (int)sizeof(file->data))
+            // A read only fills as much of the buffer as the file has
+            if (f->a3 == SYS_READFILE && (size_t)len > file->size)
                 len = file->size;
+            if (!vm_access(buf, len, f->a3 == SYS_WRITEFILE ? PROT_READ : PROT_WRITE)) {
+                f->a0 = -1;
+                break;
+            }
 
-            // Read or write the file
+            // Read or write the whole file
             if (f->a3 == SYS_WRITEFILE) {
-                memcpy(file->data, buf, len);
-                file->size = len;
-                fs_flush();
+                if (fs_truncate(file, len) < 0 || fs_write(file, 0, buf, len) < 0) {
+                    printf("no space left for %s\n", filename);
+                    f->a0 = -1;
+                    break;
+                }
             } else {
-                memcpy(buf, file->data, len);
+                // The length is truncated to the file size
+                len = fs_read(file, 0, buf, len);
             }
 
             f->a0 = len;
             break;
         }
+        case SYS_SYNC:
+            // Write back the modified files now instead of FS_FLUSH_MS after the first modification
+            fs_flush();
+            printf("bcache: %d hits, %d misses, %d blocks read ahead, %d writes\n", bcache_stats.hits, bcache_stats.misses,
+                   bcache_stats.readahead, bcache_stats.writebacks);
+            f->a0 = 0;
+            break;
+        case SYS_SETPRIO: {
+            // a0 contains the new priority of the calling process
+            const int prio = f->a0;
+            if (prio < 0 || prio >= PRIO_LEVELS) {
+                f->a0 = -1;
+                break;
+            }
+
+            current_proc->priority = prio;
+            f->a0 = 0;
+            break;
+        }
         default:
             PANIC("unexpected syscall a3=%x\n", f->a3);
     }
 }
 
 /**
- * Handles a trap by printing an error message with the trap cause, trap value, and user program counter.
+ * Reads the 64-bit time CSR, retrying if the upper half changed while the lower half was read.
+ */
+static uint64_t timer_now(void) {
+    uint32_t hi, lo;
+    do {
+        hi = READ_CSR(timeh);
+        lo = READ_CSR(time);
+    } while (hi != READ_CSR(timeh));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * Programs the SBI timer to raise a supervisor timer interrupt when the current time slice ends. Setting the timer also
+ * clears the pending interrupt.
+ */
+static void timer_set_next(void) {
+    const uint64_t deadline = timer_now() + (uint64_t)TIMER_FREQ * TIME_SLICE_MS / 1000;
+    const struct sbiret ret = sbi_call(deadline, deadline >> 32, 0, 0, 0, 0, 0 /* sbi_set_timer */, SBI_EXT_TIME);
+    if (ret.error)
+        sbi_call(deadline, deadline >> 32, 0, 0, 0, 0, 0, SBI_EXT_LEGACY_SET_TIMER);
+}
+
+/**
+ * Handles a timer interrupt: arms the next time slice, writes back modified files when their delay is over, and polls
+ * the event sources that cannot interrupt. The SBI console has no input interrupt, so processes waiting for input are
+ * woken to check for it; the UART console wakes them itself.
+ */
+void timer_tick(void) {
+    timer_set_next();
+    fs_tick();
+#ifndef CONFIG_UART_CONSOLE
+    wake_up(&console_wq);
+#endif
+}
+
+/**
+ * Starts preemptive scheduling: enables the supervisor timer interrupt and arms the first time slice. Interrupts are
+ * only taken in user mode (sstatus.SIE stays clear in the kernel), so a process can only be preempted between traps.
+ */
+void timer_init(void) {
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE);
+    timer_set_next();
+    printf("timer: %d ms time slice\n", TIME_SLICE_MS);
+}
+
+/**
+ * Handles a trap: system calls, timer and device interrupts and page faults are dispatched, anything else panics with
+ * the trap cause, trap value, and user program counter.
  * @param f A pointer to the trap frame.
  */
 void handle_trap(struct trap_frame* f) {
     uint32_t scause = READ_CSR(scause);
     uint32_t stval = READ_CSR(stval);
     uint32_t user_pc = READ_CSR(sepc);  // user program counter
+#ifdef CONFIG_VECTOR
+    vector_trap_enter();
+#endif
+
     if (scause == SCAUSE_ECALL) {
         handle_syscall(f);
         user_pc += 4;  // skip ecall instruction
-        WRITE_CSR(sepc, user_pc);
-        return;
+    } else if (scause == (SCAUSE_INTERRUPT | IRQ_S_TIMER)) {
+        // The time slice is over: arm the next one and preempt the process
+        timer_tick();
+        yield();
+    } else if (scause == (SCAUSE_INTERRUPT | IRQ_S_EXTERNAL)) {
+        // Device interrupt: the handlers wake up waiting processes, which run on the next switch
+        plic_handle();
+    } else if (scause == SCAUSE_INST_PAGE_FAULT || scause == SCAUSE_LOAD_PAGE_FAULT || scause == SCAUSE_STORE_PAGE_FAULT) {
+        // Fault in a page of a mapped region and retry the instruction; any other fault kills the process
+        const int access = scause == SCAUSE_INST_PAGE_FAULT ? PROT_EXEC : scause == SCAUSE_LOAD_PAGE_FAULT ? PROT_READ : PROT_WRITE;
+        if (!vm_fault(stval, access)) {
+            printf("process %d: segmentation fault at %x, sepc=%x\n", current_proc->pid, stval, user_pc);
+            exit_process();
+        }
+    } else {
+        PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
+    }
+
+    // sepc is restored because other processes trap while this one is switched out
+    WRITE_CSR(sepc, user_pc);
+#ifdef CONFIG_VECTOR
+    vector_trap_exit();
+#endif
+}
+
+/**
+ * Detects how many ASID bits the hart implements by writing all ones to the satp ASID field and reading it back. Paging
+ * is left enabled on the idle process's page table.
+ */
+void asid_init(void) {
+    const uint32_t satp = SATP_SV32 | ((uint32_t)idle_proc->page_table / PAGE_SIZE);
+    WRITE_CSR(satp, satp | SATP_ASID_MASK);
+    asid_max = (READ_CSR(satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    WRITE_CSR(satp, satp);
+    __asm__ __volatile__("sfence.vma");
+    printf("asid: %d ASIDs available\n", asid_max);
+}
+
+/**
+ * Makes sure the process owns an ASID of the current generation, allocating one if needed. When the ASIDs run out, a
+ * new generation is started and every process picks up a fresh ASID on its next switch.
+ *
+ * @param proc The process about to be switched to.
+ * @return True if the whole non-global TLB must be flushed when switching to the process.
+ */
+static bool asid_assign(struct process* proc) {
+    if (proc == idle_proc)
+        return false;  // ASID 0: only global kernel mappings
+    if (!asid_max)
+        return true;  // No ASID support: flush on every switch
+    if (proc->asid_gen == asid_generation)
+        return false;
+
+    bool flush = false;
+    if (asid_next > asid_max) {
+        asid_generation++;
+        asid_next = 1;
+        flush = true;
+    }
+
+    proc->asid = asid_next++;
+    proc->asid_gen = asid_generation;
+    // A fresh ASID has no TLB entries, but the page table stores must be ordered before the first walk
+    if (!flush)
+        __asm__ __volatile__("sfence.vma zero, %0" ::"r"(proc->asid));
+    return flush;
+}
+
+/**
+ * Appends a runnable process to the tail of the run queue list of its priority.
+ *
+ * @param proc The process to enqueue.
+ */
+void runqueue_push(struct process* proc) {
+    const int prio = proc->priority;
+    proc->rq_next = NULL;
+    if (run_queue.tail[prio])
+        run_queue.tail[prio]->rq_next = proc;
+    else
+        run_queue.head[prio] = proc;
+    run_queue.tail[prio] = proc;
+    run_queue.bitmap |= 1u << prio;
+}
+
+/**
+ * Removes and returns the process at the head of the highest priority non-empty list in O(1).
+ *
+ * @return The next process to run, or NULL if the run queue is empty.
+ */
+struct process* runqueue_pop(void) {
+    if (!run_queue.bitmap)
+        return NULL;
+
+    const int prio = __builtin_ctz(run_queue.bitmap);
+    struct process* proc = run_queue.head[prio];
+    run_queue.head[prio] = proc->rq_next;
+    if (!run_queue.head[prio]) {
+        run_queue.tail[prio] = NULL;
+        run_queue.bitmap &= ~(1u << prio);
+    }
+    proc->rq_next = NULL;
+    return proc;
+}
+
+/**
+ * Blocks the current process on a wait queue until wake_up() is called on it. The process leaves the run queue, so it
+ * uses no CPU while it waits. Callers re-check their condition after returning, since every waiter is woken.
+ *
+ * @param wq The wait queue to sleep on.
+ */
+void sleep_on(struct wait_queue* wq) {
+    if (!can_sleep())
+        PANIC("sleep_on: the idle process cannot sleep");
+
+    current_proc->state = PROC_BLOCKED;
+    current_proc->rq_next = NULL;
+    if (wq->tail)
+        wq->tail->rq_next = current_proc;
+    else
+        wq->head = current_proc;
+    wq->tail = current_proc;
+    yield();
+}
+
+/**
+ * Makes every process blocked on a wait queue runnable again.
+ *
+ * @param wq The wait queue to wake up.
+ */
+void wake_up(struct wait_queue* wq) {
+    struct process* proc = wq->head;
+    wq->head = wq->tail = NULL;
+    while (proc) {
+        struct process* next = proc->rq_next;
+        proc->state = PROC_RUNNABLE;
+        runqueue_push(proc);
+        proc = next;
     }
+}
 
-    PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
+/**
+ * Returns whether the kernel is running on behalf of a process that may block. During boot and in the idle process,
+ * callers have to busy-wait instead.
+ */
+bool can_sleep(void) {
+    return current_proc && current_proc != idle_proc;
 }
 
 /**
- * This function yields the CPU to the next runnable process. It searches for the next runnable process
- * and if found, saves the current stack pointer, switches the context to the next process and restores
- * the stack pointer of the next process. If there are no other runnable processes, it continues running
- * the current process.
+ * This function yields the CPU to the next runnable process. The current process goes back to the tail of its run queue
+ * list if it is still runnable, and the head of the highest priority list is switched to. The idle process runs only
+ * when the run queue is empty.
  *
  * @return void
  */
 void yield(void) {
-    // Find the next runnable process
-    struct process* next = idle_proc;
-    for (int i = 0; i < PROCS_MAX; i++) {
-        struct process* proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-            next = proc;
-            break;
+    // Buffered console output must not wait for the next process
+    console_flush();
+
+    // Free the exited processes, except the current one if it has just exited
+    struct process** link = &zombies;
+    while (*link) {
+        struct process* zombie = *link;
+        if (zombie == current_proc) {
+            link = &zombie->rq_next;
+            continue;
         }
+
+        *link = zombie->rq_next;
+        destroy_process(zombie);
     }
 
+    // Requeue the current process and pick the next one
+    if (current_proc != idle_proc && current_proc->state == PROC_RUNNABLE)
+        runqueue_push(current_proc);
+
+    struct process* next = runqueue_pop();
+    if (!next)
+        next = idle_proc;
+
     // There are no other runnable processes, so continue running the current process
     if (next == current_proc)
         return;
 
-    // Context switch to the next process
+    // Context switch to the next process, with a full time slice rather than what is left of the previous one's
     struct process* prev = current_proc;
     current_proc = next;
+    timer_set_next();
+
+    // Switch the page table, tagging it with the next process's ASID so that its TLB entries (and the global kernel
+    // entries) survive the switch. The TLB is only flushed when ASIDs are recycled or not supported.
+    const bool flush = asid_assign(next);
+    const uint32_t satp = SATP_SV32 | (next->asid << SATP_ASID_SHIFT) | ((uint32_t)next->page_table / PAGE_SIZE);
+    if (flush) {
+        __asm__ __volatile__(
+            "sfence.vma\n"
+            "csrw satp, %[satp]\n"
+            "sfence.vma\n"
+            :
+            : [satp] "r"(satp));
+    } else {
+        __asm__ __volatile__("csrw satp, %[satp]\n" : : [satp] "r"(satp));
+    }
 
-    // Save the current stack pointer and set the stack pointer to the top of the stack of the next process and switch the page
-    // table
-    __asm__ __volatile__(
-        "sfence.vma\n"
-        "csrw satp, %[satp]\n"
-        "sfence.vma\n"
-        "csrw sscratch, %[sscratch]\n"
-        :
-        : [satp] "r"(SATP_SV32 | ((uint32_t)next->page_table / PAGE_SIZE)), [sscratch] "r"((uint32_t)&next->stack[sizeof(next->stack)]));
+    // Set the kernel stack used by the next trap from user mode
+    __asm__ __volatile__("csrw sscratch, %[sscratch]\n" : : [sscratch] "r"((uint32_t)next->stack + KERNEL_STACK_SIZE));
 
+#ifdef CONFIG_VECTOR
+    vector_switch();
+#endif
     switch_context(&prev->sp, &next->sp);
 }
-
-long getchar(void) {
-    const struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2);
-    return ret.error;
-}
\ No newline at end of file
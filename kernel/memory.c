@@ -4,45 +4,239 @@ extern char __free_ram[], __free_ram_end[];
 
 struct free_list page_list;
 
+/**
+ * Returns the smallest order whose block (2^order pages) can hold n pages.
+ *
+ * @param n The number of pages.
+ * @return The buddy order for n pages.
+ */
+static uint32_t order_for_pages(size_t n) {
+    uint32_t order = 0;
+    while ((1u << order) < n)
+        order++;
+    return order;
+}
+
+// Converts a page frame index inside the pool to its physical address and back.
+static paddr_t page_index_to_paddr(const struct free_list* free_list, size_t idx) {
+    return free_list->base + idx * PAGE_SIZE;
+}
+
+static size_t paddr_to_page_index(const struct free_list* free_list, paddr_t paddr) {
+    return (paddr - free_list->base) / PAGE_SIZE;
+}
+
+/**
+ * Pushes the block starting at page frame idx onto the free list of the given order. The list links are stored in the
+ * first bytes of the free block itself, so the allocator needs no memory besides page_order[].
+ */
+static void free_area_push(struct free_list* free_list, size_t idx, uint32_t order) {
+    struct free_block* block = (struct free_block*)page_index_to_paddr(free_list, idx);
+    block->prev = NULL;
+    block->next = free_list->free_area[order];
+    if (block->next)
+        block->next->prev = block;
+    free_list->free_area[order] = block;
+    free_list->page_order[idx] = order | PAGE_ORDER_FREE;
+}
+
+/**
+ * Unlinks the free block starting at page frame idx from the free list of the given order in O(1).
+ */
+static void free_area_remove(struct free_list* free_list, size_t idx, uint32_t order) {
+    struct free_block* block = (struct free_block*)page_index_to_paddr(free_list, idx);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        free_list->free_area[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    free_list->page_order[idx] = order;
+}
+
+/**
+ * Initializes the buddy allocator over __free_ram..__free_ram_end in O(1). The page_order[] and page_refs[] tables are
+ * placed at the start of free RAM and are never cleared; untouched memory is handed out by a bump pointer and only
+ * blocks that have been freed go onto the free lists, so boot cost does not depend on NUM_PAGES.
+ *
+ * @param free_list The allocator to initialize.
+ */
 void init_free_list(struct free_list* free_list) {
-    // Initialize the free list
-    for (size_t i = 0; i < NUM_PAGES; i++) {
-        free_list->page_frame_addr[i] = (paddr_t)__free_ram + i * PAGE_SIZE;
+    const size_t meta_pages = align_up(NUM_PAGES * (sizeof(uint8_t) + sizeof(uint16_t)), PAGE_SIZE) / PAGE_SIZE;
+    free_list->page_order = (uint8_t*)__free_ram;
+    free_list->page_refs = (uint16_t*)(__free_ram + NUM_PAGES);
+    free_list->base = (paddr_t)__free_ram + meta_pages * PAGE_SIZE;
+    free_list->num_pages = ((paddr_t)__free_ram_end - free_list->base) / PAGE_SIZE;
+    if (free_list->num_pages > NUM_PAGES)
+        free_list->num_pages = NUM_PAGES;
+    free_list->bump = 0;
+
+    for (uint32_t order = 0; order <= MAX_ORDER; order++)
+        free_list->free_area[order] = NULL;
+}
+
+/**
+ * Marks the page frames of a block after the first one, so that free_page() rejects pointers into the block.
+ */
+static void mark_tail(struct free_list* free_list, size_t idx, uint32_t order) {
+    for (size_t i = 1; i < (1u << order); i++)
+        free_list->page_order[idx + i] = PAGE_ORDER_TAIL;
+}
+
+/**
+ * Carves a naturally aligned block of the given order from the untouched memory above the bump pointer. Pages skipped
+ * to reach the alignment are pushed onto the free lists as the largest aligned blocks that fit.
+ *
+ * @return The page frame index of the block, or -1 if the untouched memory is exhausted.
+ */
+static int bump_alloc(struct free_list* free_list, uint32_t order) {
+    const size_t idx = align_up(free_list->bump, 1u << order);
+    if (idx + (1u << order) > free_list->num_pages)
+        return -1;
+
+    while (free_list->bump < idx) {
+        uint32_t skip = 0;
+        while (is_aligned(free_list->bump, 1u << (skip + 1)) && free_list->bump + (1u << (skip + 1)) <= idx)
+            skip++;
+        free_area_push(free_list, free_list->bump, skip);
+        mark_tail(free_list, free_list->bump, skip);
+        free_list->bump += 1u << skip;
+    }
+
+    free_list->bump = idx + (1u << order);
+    free_list->page_order[idx] = order;
+    mark_tail(free_list, idx, order);
+    return idx;
+}
+
+/**
+ * Allocates n physically contiguous pages. The request is rounded up to the next power of two, taken from the smallest
+ * non-empty free list of a sufficient order and split down, returning the unused halves to the lower-order lists.
+ * The returned memory is zero-filled and has one reference.
+ *
+ * @param n The number of pages to allocate.
+ * @return The physical address of the first page, or 0 if there is not enough contiguous memory available.
+ */
+paddr_t try_alloc_page(struct free_list* free_list, size_t n) {
+    if (n == 0)
+        PANIC("alloc_page: zero pages requested");
+
+    const uint32_t order = order_for_pages(n);
+    uint32_t cur = order;
+    while (cur <= MAX_ORDER && !free_list->free_area[cur])
+        cur++;
+
+    size_t idx;
+    if (cur > MAX_ORDER) {
+        // Nothing suitable has been freed yet: take fresh memory from the bump pointer
+        const int fresh = bump_alloc(free_list, order);
+        if (fresh < 0)
+            return 0;
+        idx = fresh;
+    } else {
+        idx = paddr_to_page_index(free_list, (paddr_t)free_list->free_area[cur]);
+        free_area_remove(free_list, idx, cur);
+
+        // Split the block, handing the upper halves back to the free lists
+        while (cur > order) {
+            cur--;
+            free_area_push(free_list, idx + (1u << cur), cur);
+        }
+        free_list->page_order[idx] = order;
     }
-    free_list->page_frame_free = 0;
+
+    free_list->page_refs[idx] = 1;
+    const paddr_t paddr = page_index_to_paddr(free_list, idx);
+    memset((void*)paddr, 0, (1u << order) * PAGE_SIZE);
+    return paddr;
 }
 
 /**
- * Allocates n pages from the free list. if you are going to fragment the free list, do not allocate more than 1 page.
+ * Allocates n physically contiguous, zero-filled pages for the kernel, which cannot do without them.
  *
  * @param n The number of pages to allocate.
  * @return The physical address of the first page.
- * @throws PANIC if there is not enough memory available.
+ * @throws PANIC if there is not enough contiguous memory available.
  */
 paddr_t alloc_page(struct free_list* free_list, size_t n) {
-    if (free_list->page_frame_free >= NUM_PAGES)
-        PANIC("out of memory");
-    if (free_list->page_frame_addr[free_list->page_frame_free] == 0) {
-        PANIC("page frame address is 0");
-    }
+    const paddr_t paddr = try_alloc_page(free_list, n);
+    if (!paddr)
+        PANIC("out of memory (%d pages requested)", n);
+    return paddr;
+}
+
+/**
+ * Drops a reference to n pages previously returned by alloc_page(free_list, n), and frees them with the last one. The
+ * block is merged with its buddy for as long as the buddy is free and of the same order.
+ *
+ * @param paddr The physical address returned by alloc_page.
+ * @param n The number of pages that was passed to alloc_page.
+ * @throws PANIC if paddr is not the start of an allocated block of that size.
+ */
+void free_page(struct free_list* free_list, paddr_t paddr, size_t n) {
+    if (!is_aligned(paddr, PAGE_SIZE) || paddr < free_list->base || paddr >= page_index_to_paddr(free_list, free_list->bump))
+        PANIC("free_page: invalid paddr %x", paddr);
+
+    size_t idx = paddr_to_page_index(free_list, paddr);
+    uint32_t order = order_for_pages(n);
+    if (free_list->page_order[idx] != order)
+        PANIC("free_page: %x is not an allocated block of %d pages", paddr, n);
+    if (--free_list->page_refs[idx] > 0)
+        return;
+
+    while (order < MAX_ORDER) {
+        const size_t buddy = idx ^ (1u << order);
+        // Memory above the bump pointer is untouched and its page_order[] entries are uninitialized
+        if (buddy + (1u << order) > free_list->bump || free_list->page_order[buddy] != (order | PAGE_ORDER_FREE))
+            break;
 
-    const paddr_t paddr = free_list->page_frame_addr[free_list->page_frame_free];
-    for (size_t i = 0; i < n; i++) {
-        if (free_list->page_frame_addr[free_list->page_frame_free + i] == 0)
-            PANIC("page frame address is 0");
-        free_list->page_frame_addr[free_list->page_frame_free + i] = 0;
+        free_area_remove(free_list, buddy, order);
+        // The upper half is now inside the merged block
+        free_list->page_order[idx > buddy ? idx : buddy] = PAGE_ORDER_TAIL;
+        if (buddy < idx)
+            idx = buddy;
+        order++;
     }
 
-    free_list->page_frame_free += n;
-    return paddr;
+    free_area_push(free_list, idx, order);
+}
+
+/**
+ * Returns the page frame index of an allocated block.
+ *
+ * @throws PANIC if paddr is not the start of an allocated block.
+ */
+static size_t allocated_page_index(const struct free_list* free_list, paddr_t paddr) {
+    if (!is_aligned(paddr, PAGE_SIZE) || paddr < free_list->base || paddr >= page_index_to_paddr(free_list, free_list->bump))
+        PANIC("invalid paddr %x", paddr);
+
+    const size_t idx = paddr_to_page_index(free_list, paddr);
+    if (free_list->page_order[idx] & (PAGE_ORDER_FREE | PAGE_ORDER_TAIL))
+        PANIC("%x is not an allocated block", paddr);
+    return idx;
 }
 
-void free_page(struct free_list* free_list, paddr_t paddr) {
-    if (free_list->page_frame_free == 0)
-        PANIC("free list is empty");
+/**
+ * Adds a reference to an allocated block, which free_page() then has to drop as well. fork() shares the user pages of
+ * a process this way.
+ *
+ * @param paddr The physical address returned by alloc_page.
+ * @throws PANIC if paddr is not the start of an allocated block or has too many references.
+ */
+void ref_page(struct free_list* free_list, paddr_t paddr) {
+    const size_t idx = allocated_page_index(free_list, paddr);
+    if (free_list->page_refs[idx] == 0xffff)
+        PANIC("ref_page: too many references to %x", paddr);
+    free_list->page_refs[idx]++;
+}
 
-    free_list->page_frame_free--;
-    free_list->page_frame_addr[free_list->page_frame_free] = paddr;
+/**
+ * Returns the number of references to an allocated block.
+ *
+ * @param paddr The physical address returned by alloc_page.
+ */
+unsigned page_refcount(struct free_list* free_list, paddr_t paddr) {
+    return free_list->page_refs[allocated_page_index(free_list, paddr)];
 }
 
 /**
@@ -72,3 +266,46 @@ void map_page(uint32_t* table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     uint32_t* table0 = (uint32_t*)((table1[vpn1] >> 10) * PAGE_SIZE);  // Get the physical address of the second level page table
     table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;       // Set the PPN (Page Physical Number) and V (Valid) bit
 }
+
+/**
+ * Maps a 4MB megapage with a single leaf entry in the first level page table, so no second level table is allocated.
+ *
+ * @param table1 Pointer to the first level page table.
+ * @param vaddr Virtual address to map, aligned to MEGAPAGE_SIZE.
+ * @param paddr Physical address to map, aligned to MEGAPAGE_SIZE.
+ * @param flags Flags to set for the page table entry (must include at least one of R, W, X to make it a leaf).
+ */
+void map_megapage(uint32_t* table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+    if (!is_aligned(vaddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage vaddr %x", vaddr);
+
+    if (!is_aligned(paddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage paddr %x", paddr);
+
+    const uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+/**
+ * Frees a process page table: every user page it maps (a page shared by fork() goes with its last mapping), its second
+ * level tables and the first level table itself. Megapage leaves (the shared kernel mappings) are skipped.
+ *
+ * @param table1 Pointer to the first level page table.
+ */
+void free_page_table(uint32_t* table1) {
+    for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+        const uint32_t pte1 = table1[vpn1];
+        if (!(pte1 & PAGE_V) || (pte1 & (PAGE_R | PAGE_W | PAGE_X)))
+            continue;
+
+        uint32_t* table0 = (uint32_t*)((pte1 >> 10) * PAGE_SIZE);
+        for (uint32_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+            const uint32_t pte0 = table0[vpn0];
+            if ((pte0 & PAGE_V) && (pte0 & PAGE_U))
+                free_page(&page_list, (pte0 >> 10) * PAGE_SIZE, 1);
+        }
+        free_page(&page_list, (paddr_t)table0, 1);
+    }
+
+    free_page(&page_list, (paddr_t)table1, 1);
+}
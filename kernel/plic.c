@@ -0,0 +1,68 @@
+#include "plic.h"
+#include "kernel.h"
+
+// Interrupt handlers registered with plic_enable() and their arguments, indexed by IRQ.
+void (*plic_handlers[PLIC_NUM_IRQS])(void* arg);
+void* plic_args[PLIC_NUM_IRQS];
+
+/**
+ * Writes a 32-bit PLIC register.
+ *
+ * @param addr The physical address of the register.
+ * @param value The value to write.
+ */
+static void plic_write32(paddr_t addr, uint32_t value) {
+    *((volatile uint32_t*)addr) = value;
+}
+
+/**
+ * Reads a 32-bit PLIC register.
+ *
+ * @param addr The physical address of the register.
+ * @return The value read from the register.
+ */
+static uint32_t plic_read32(paddr_t addr) {
+    return *((volatile uint32_t*)addr);
+}
+
+/**
+ * Routes the PLIC to the supervisor external interrupt of PLIC_HART. Every source stays disabled until a driver
+ * registers a handler for it.
+ */
+void plic_init(void) {
+    plic_write32(PLIC_STHRESHOLD(PLIC_HART), 0);
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
+
+/**
+ * Enables an interrupt source and registers the handler that plic_handle() calls when it fires.
+ *
+ * @param irq The interrupt source number.
+ * @param handler The function handling the interrupt.
+ * @param arg The argument passed to the handler, typically the device.
+ */
+void plic_enable(unsigned irq, void (*handler)(void* arg), void* arg) {
+    if (irq == 0 || irq >= PLIC_NUM_IRQS)
+        PANIC("plic: invalid irq %d", irq);
+
+    plic_handlers[irq] = handler;
+    plic_args[irq] = arg;
+    plic_write32(PLIC_PRIORITY(irq), 1);
+    const paddr_t enable = PLIC_SENABLE(PLIC_HART) + (irq / 32) * 4;
+    plic_write32(enable, plic_read32(enable) | (1u << (irq % 32)));
+}
+
+/**
+ * Handles a supervisor external interrupt: claims every pending source, runs its handler and signals completion.
+ */
+void plic_handle(void) {
+    uint32_t irq;
+    while ((irq = plic_read32(PLIC_SCLAIM(PLIC_HART))) != 0) {
+        if (irq < PLIC_NUM_IRQS && plic_handlers[irq])
+            plic_handlers[irq](plic_args[irq]);
+        else
+            printf("plic: unexpected irq %d\n", irq);
+
+        plic_write32(PLIC_SCLAIM(PLIC_HART), irq);
+    }
+}
@@ -1,8 +1,25 @@
 #include "tarfs.h"
-#include "virtio.h"
+#include "bcache.h"
 
-struct file files[FILES_MAX];
-uint8_t disk[DISK_MAX_SIZE];
+// The archive is read and written through the block cache; only its index is kept in memory.
+unsigned archive_end;  // Offset of the end-of-archive marker
+
+// The file index: a hash table of chains, grown when there are more files than buckets.
+struct file** fs_table;
+unsigned fs_table_size;
+unsigned fs_nfiles;
+// Files in archive order (by offset), and the page being carved into struct files.
+struct file* fs_files;
+struct file* fs_files_tail;
+struct file* fs_pool;
+unsigned fs_pool_free;
+// Files whose tar header has to be rewritten before the next write back.
+struct file* fs_dirty;
+// Timer ticks left before the modified files are written back, 0 if there is nothing to write.
+unsigned fs_flush_ticks;
+// fs_busy is set while a process accesses the archive, which may sleep on the disk; others wait on fs_wq.
+bool fs_busy;
+struct wait_queue fs_wq;
 
 /**
  * Converts an octal string to an integer.
@@ -23,92 +40,420 @@ int oct2int(char* oct, int len) {
 }
 
 /**
- * Initializes the file system by reading the disk and parsing the tar headers.
+ * Converts an integer to a zero-padded, NUL-terminated octal string.
  *
- * Reads the disk sector by sector and parses the tar headers to populate the file system.
- * The function reads the disk sector by sector and checks the magic number of each tar header.
- * If the magic number is not "ustar", the function panics.
- * Otherwise, the function populates the file system with the file name, data, and size.
+ * @param oct The field to write.
+ * @param len The size of the field, including the NUL.
+ * @param dec The integer to convert.
+ */
+static void int2oct(char* oct, int len, unsigned dec) {
+    oct[len - 1] = '\0';
+    for (int i = len - 2; i >= 0; i--) {
+        oct[i] = (dec % 8) + '0';
+        dec /= 8;
+    }
+}
+
+/**
+ * Hashes a file name (FNV-1a).
  *
- * @return void
+ * @param name The file name.
+ * @return The hash value.
  */
-void fs_init(void) {
-    // Read the disk sector by sector and populate the file system.
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++) {
-        printf("Reading disk sector %d\n", sector);
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
+static uint32_t fs_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Waits until no other process is accessing the archive, and claims it. Callers that cannot sleep must
+ * check fs_busy first.
+ */
+static void fs_lock(void) {
+    while (fs_busy)
+        sleep_on(&fs_wq);
+    fs_busy = true;
+}
+
+/**
+ * Releases the archive claimed by fs_lock().
+ */
+static void fs_unlock(void) {
+    fs_busy = false;
+    wake_up(&fs_wq);
+}
+
+/**
+ * Adds a file to the hash table, doubling the table when it has more files than buckets.
+ *
+ * @param file The file to add.
+ */
+static void fs_hash_insert(struct file* file) {
+    if (fs_nfiles >= fs_table_size) {
+        const unsigned size = fs_table_size ? fs_table_size * 2 : FS_HASH_MIN;
+        struct file** table = (struct file**)alloc_page(&page_list, size * sizeof(*table) / PAGE_SIZE);
+        for (unsigned i = 0; i < fs_table_size; i++) {
+            struct file* next;
+            for (struct file* f = fs_table[i]; f; f = next) {
+                next = f->hash_next;
+                const unsigned bucket = fs_hash(f->name) & (size - 1);
+                f->hash_next = table[bucket];
+                table[bucket] = f;
+            }
+        }
+
+        if (fs_table)
+            free_page(&page_list, (paddr_t)fs_table, fs_table_size * sizeof(*table) / PAGE_SIZE);
+        fs_table = table;
+        fs_table_size = size;
     }
-    // Parse the tar headers and populate the file system.
+
+    const unsigned bucket = fs_hash(file->name) & (fs_table_size - 1);
+    file->hash_next = fs_table[bucket];
+    fs_table[bucket] = file;
+    fs_nfiles++;
+}
+
+/**
+ * Moves a file to the end of the archive order list, after its entry has been placed at the end of the archive.
+ *
+ * @param file The file.
+ */
+static void fs_move_to_tail(struct file* file) {
+    if (file == fs_files_tail)
+        return;
+
+    struct file** prev = &fs_files;
+    while (*prev != file)
+        prev = &(*prev)->next;
+    *prev = file->next;
+    file->next = NULL;
+    fs_files_tail->next = file;
+    fs_files_tail = file;
+}
+
+/**
+ * Indexes a tar entry. A later entry with the same name replaces the earlier one, as when tar extracts the archive.
+ *
+ * @param header The tar header.
+ * @param offset The offset of the header in the archive.
+ * @param size The file size.
+ */
+static void fs_add(const struct tar_header* header, unsigned offset, size_t size) {
+    // The full name is the prefix, a slash and the name; neither field needs to be NUL-terminated
+    char name[TAR_NAME_MAX];
+    int len = 0;
+    for (unsigned i = 0; i < sizeof(header->prefix) && header->prefix[i]; i++)
+        name[len++] = header->prefix[i];
+    if (len > 0)
+        name[len++] = '/';
+    for (unsigned i = 0; i < sizeof(header->name) && header->name[i]; i++)
+        name[len++] = header->name[i];
+    name[len] = '\0';
+
+    struct file* file = fs_lookup(name);
+    if (!file) {
+        if (!fs_pool_free) {
+            fs_pool = (struct file*)alloc_page(&page_list, 1);
+            fs_pool_free = PAGE_SIZE / sizeof(struct file);
+        }
+        file = fs_pool++;
+        fs_pool_free--;
+
+        strcpy(file->name, name);
+        if (fs_files_tail)
+            fs_files_tail->next = file;
+        else
+            fs_files = file;
+        fs_files_tail = file;
+        fs_hash_insert(file);
+    } else {
+        fs_move_to_tail(file);
+    }
+
+    file->offset = offset;
+    file->size = size;
+}
+
+/**
+ * Initializes the file system by walking the tar archive on the disk and indexing its entries.
+ *
+ * Only the headers are read, through the block cache, whose read-ahead turns the walk into large sequential requests.
+ * The walk stops at the end-of-archive marker or at the end of the disk, and panics on a header whose magic number is
+ * not "ustar" or on an entry that runs past the end of the disk.
+ */
+void fs_init(void) {
+    const unsigned capacity = blk_devs[0].capacity;
     unsigned off = 0;
-    for (int i = 0; i < FILES_MAX; i++) {
+    while (off + SECTOR_SIZE <= capacity) {
         // Check if the tar header is empty.
-        struct tar_header* header = (struct tar_header*)&disk[off];
-        if (header->name[0] == '\0')
+        struct tar_header header;
+        if (bcache_read(&blk_devs[0], off, &header, sizeof(header)) < 0)
+            PANIC("failed to read the disk");
+        if (header.name[0] == '\0')
             break;
 
         // Check if the magic number is "ustar".
-        if (strcmp(header->magic, "ustar") != 0)
-            PANIC("invalid tar header: magic=\"%s\"", header->magic);
-
-        // Populate the file system with the file name, data, and size.
-        const int filesz = oct2int(header->size, sizeof(header->size));
-        struct file* file = &files[i];
-        file->in_use = true;
-        strcpy(file->name, header->name);
-        memcpy(file->data, header->data, filesz);
-        file->size = filesz;
-        printf("file: %s, size=%d\n", file->name, file->size);
+        if (strcmp(header.magic, "ustar") != 0)
+            PANIC("invalid tar header: magic=\"%s\"", header.magic);
+
+        const int filesz = oct2int(header.size, sizeof(header.size));
+        const unsigned next = off + align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+        if (next > capacity)
+            PANIC("tar entry at %d runs past the end of the disk", off);
+
+        fs_add(&header, off, filesz);
 
         // Move to the next tar header.
-        off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+        off = next;
     }
+
+    archive_end = off;
+    printf("tarfs: %d files, %d bytes\n", fs_nfiles, archive_end);
 }
 
-// Write contents of each file in the files variable to the disk variable.
-void fs_flush(void) {
-    memset(disk, 0, sizeof(disk));
-    unsigned off = 0;
-    for (int file_i = 0; file_i < FILES_MAX; file_i++) {
-        const struct file* file = &files[file_i];
-        if (!file->in_use)
-            continue;
+/**
+ * Reads part of a file.
+ *
+ * @param file The file.
+ * @param offset The offset in the file.
+ * @param buf The destination.
+ * @param len The number of bytes to read.
+ * @return The number of bytes read (less than len at the end of the file), or -1 if the disk failed.
+ */
+int fs_read(const struct file* file, unsigned offset, void* buf, size_t len) {
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+
+    fs_lock();
+    const int ret = bcache_read(&blk_devs[0], file->offset + sizeof(struct tar_header) + offset, buf, len);
+    fs_unlock();
+    return ret < 0 ? -1 : (int)len;
+}
+
+/**
+ * Rewrites the size and the checksum of a file's tar header. The other fields (mode, owner, mtime) are kept.
+ *
+ * @param file The file.
+ * @return 0 on success, or -1 if the disk failed.
+ */
+static int fs_write_header(const struct file* file) {
+    struct tar_header header;
+    if (bcache_read(&blk_devs[0], file->offset, &header, sizeof(header)) < 0)
+        return -1;
+    int2oct(header.size, sizeof(header.size), file->size);
+
+    // The checksum is computed with the checksum field set to spaces
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned checksum = 0;
+    for (unsigned i = 0; i < sizeof(header); i++)
+        checksum += ((uint8_t*)&header)[i];
+    int2oct(header.checksum, sizeof(header.checksum) - 1, checksum);
+    return bcache_write(&blk_devs[0], file->offset, &header, sizeof(header));
+}
+
+/**
+ * Queues a modified file for the next write back, and arms the write back delay.
+ *
+ * @param file The file.
+ */
+static void fs_modified(struct file* file) {
+    if (!file->dirty) {
+        file->dirty = true;
+        file->dirty_next = fs_dirty;
+        fs_dirty = file;
+    }
+    if (!fs_flush_ticks)
+        fs_flush_ticks = FS_FLUSH_MS / TIME_SLICE_MS ? FS_FLUSH_MS / TIME_SLICE_MS : 1;
+}
+
+/**
+ * Copies sectors of the archive to another place, a sector at a time. The destination may overlap the source if it is
+ * lower.
+ *
+ * @param to The destination offset.
+ * @param from The source offset.
+ * @param len The number of bytes, a multiple of SECTOR_SIZE.
+ * @return 0 on success, or -1 if the disk failed.
+ */
+static int fs_copy(unsigned to, unsigned from, unsigned len) {
+    struct virtio_blk* blk = &blk_devs[0];
+    uint8_t buf[SECTOR_SIZE];
+    for (unsigned i = 0; i < len; i += SECTOR_SIZE) {
+        if (bcache_read(blk, from + i, buf, SECTOR_SIZE) < 0)
+            return -1;
+        // Whole sectors are overwritten without reading them, so this write cannot fail
+        bcache_write(blk, to + i, buf, SECTOR_SIZE);
+    }
+    return 0;
+}
 
-        struct tar_header* header = (struct tar_header*)&disk[off];
-        memset(header, 0, sizeof(*header));
-        strcpy(header->name, file->name);
-        strcpy(header->mode, "000644");
-        strcpy(header->magic, "ustar");
-        strcpy(header->version, "00");
-        header->type = '0';
-
-        // Convert file size to octal string
-        int filesz = file->size;
-        int i = 0;
-        do {
-            header->size[i++] = (filesz % 8) + '0';
-            filesz /= 8;
-        } while (filesz > 0);
-
-        // Calculate checksum
-        int checksum = ' ' * sizeof(header->checksum);
-        for (unsigned i = 0; i < sizeof(struct tar_header); i++)
-            checksum += (unsigned char)disk[off + i];
-
-        for (int i = 5; i >= 0; i--) {
-            header->checksum[i] = (checksum % 8) + '0';
-            checksum /= 8;
+/**
+ * Packs the entries of the archive, with the archive claimed: each file is moved down over the superseded copies left
+ * by fs_resize(), and the end-of-archive marker follows the last one.
+ *
+ * @return 0 on success, or -1 if the disk failed (the files moved so far are consistent).
+ */
+static int fs_compact(void) {
+    unsigned to = 0;
+    for (struct file* file = fs_files; file; file = file->next) {
+        const unsigned len = align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+        if (file->offset != to) {
+            if (fs_copy(to, file->offset, len) < 0)
+                return -1;
+            file->offset = to;
         }
+        to += len;
+    }
+
+    archive_end = to;
+    bcache_write(&blk_devs[0], archive_end, NULL, TAR_END_SIZE);
+    return 0;
+}
 
-        // Copy file data
-        memcpy(header->data, file->data, file->size);
-        off += align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+/**
+ * Returns where a file of a new length goes: its entry stays in place if it takes as many sectors as before, or if it is
+ * the last entry of the archive. Otherwise it is copied to the end of the archive.
+ */
+static unsigned fs_place(const struct file* file, unsigned len) {
+    const unsigned old_len = align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+    return old_len == len || file->offset + old_len == archive_end ? file->offset : archive_end;
+}
+
+/**
+ * Changes the size of a file, with the archive claimed. If the entry has to move to the end of the archive, the old one
+ * is left behind: it is superseded, as when tar extracts the archive. When the disk is full, the archive is compacted
+ * to reclaim the superseded entries. Bytes added to the file read as zeros.
+ *
+ * @param file The file.
+ * @param size The new size.
+ * @return 0 on success, or -1 if the archive does not fit on the disk or the disk failed.
+ */
+static int fs_resize(struct file* file, size_t size) {
+    struct virtio_blk* blk = &blk_devs[0];
+    const unsigned len = align_up(sizeof(struct tar_header) + size, SECTOR_SIZE);
+    unsigned offset = fs_place(file, len);
+    if (offset + len + TAR_END_SIZE > blk->capacity) {
+        if (fs_compact() < 0)
+            return -1;
+        offset = fs_place(file, len);
+        if (offset + len + TAR_END_SIZE > blk->capacity)
+            return -1;
     }
 
-    // Write the disk sector by sector.
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+    const unsigned new_end = offset + len;
+    const bool last = file->offset + align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE) == archive_end;
+    const size_t kept = size < file->size ? size : file->size;
+    if (offset != file->offset) {
+        // Copy the header and the data that is kept
+        if (fs_copy(offset, file->offset, align_up(sizeof(struct tar_header) + kept, SECTOR_SIZE)) < 0)
+            return -1;
+        file->offset = offset;
+        fs_move_to_tail(file);
+    }
 
-    printf("wrote %d bytes to disk\n", sizeof(disk));
+    // Zero everything past the kept data, up to the end of the last sector
+    const unsigned data = offset + sizeof(struct tar_header);
+    if (bcache_write(blk, data + kept, NULL, new_end - data - kept) < 0)
+        return -1;
+    file->size = size;
+    if (last || offset == archive_end) {
+        // Move the end-of-archive marker
+        archive_end = new_end;
+        bcache_write(blk, archive_end, NULL, TAR_END_SIZE);
+    }
+    fs_modified(file);
+    return 0;
+}
+
+/**
+ * Writes part of a file, growing it if the write ends past its end. The data goes to the block cache, and the header is
+ * rewritten by the next fs_flush(), which runs FS_FLUSH_MS later (or right away if FS_FLUSH_MS is 0).
+ *
+ * @param file The file.
+ * @param offset The offset in the file; a gap past the end of the file reads as zeros.
+ * @param buf The data.
+ * @param len The number of bytes to write.
+ * @return The number of bytes written, or -1 if the archive does not fit on the disk or the disk failed.
+ */
+int fs_write(struct file* file, unsigned offset, const void* buf, size_t len) {
+    // Nothing is written, so the file does not grow even if offset is past its end
+    if (len == 0)
+        return 0;
+
+    fs_lock();
+    int ret = 0;
+    if (offset + len > file->size)
+        ret = fs_resize(file, offset + len);
+    if (ret == 0)
+        ret = bcache_write(&blk_devs[0], file->offset + sizeof(struct tar_header) + offset, buf, len);
+    if (ret == 0)
+        fs_modified(file);
+    fs_unlock();
+
+    if (ret == 0 && FS_FLUSH_MS == 0)
+        fs_flush();
+    return ret < 0 ? -1 : (int)len;
+}
+
+/**
+ * Changes the size of a file: it is cut, or padded with zeros.
+ *
+ * @param file The file.
+ * @param size The new size.
+ * @return 0 on success, or -1 if the archive does not fit on the disk or the disk failed.
+ */
+int fs_truncate(struct file* file, size_t size) {
+    fs_lock();
+    const int ret = size == file->size ? 0 : fs_resize(file, size);
+    fs_unlock();
+
+    if (ret == 0 && FS_FLUSH_MS == 0)
+        fs_flush();
+    return ret;
+}
+
+/**
+ * Writes the modified parts of the archive back to the disk and makes them durable: the headers of the modified files
+ * are rewritten, then the block cache writes back the dirty sectors.
+ */
+void fs_flush(void) {
+    fs_lock();
+    struct file** prev = &fs_dirty;
+    while (*prev) {
+        struct file* file = *prev;
+        if (fs_write_header(file) < 0) {
+            // Keep the file queued for the next flush
+            prev = &file->dirty_next;
+            continue;
+        }
+        file->dirty = false;
+        *prev = file->dirty_next;
+    }
+
+    const int written = bcache_flush(&blk_devs[0]);
+    // Anything left dirty is retried on the next tick
+    fs_flush_ticks = written < 0 || fs_dirty ? 1 : 0;
+    if (written > 0)
+        printf("wrote %d sectors to disk\n", written);
+    fs_unlock();
+}
+
+/**
+ * Called on every timer tick: writes back the modified files once FS_FLUSH_MS have passed since the first modification.
+ * The write back is left for a later tick if a process is using the archive.
+ */
+void fs_tick(void) {
+    if (!fs_flush_ticks || fs_busy)
+        return;
+    if (--fs_flush_ticks == 0)
+        fs_flush();
 }
 
 /**
@@ -118,11 +463,13 @@ void fs_flush(void) {
  * @return A pointer to the file struct if found, or NULL if not found.
  */
 struct file* fs_lookup(const char* filename) {
-    for (int i = 0; i < FILES_MAX; i++) {
-        struct file* file = &files[i];
+    if (!fs_table)
+        return NULL;
+
+    for (struct file* file = fs_table[fs_hash(filename) & (fs_table_size - 1)]; file; file = file->hash_next) {
         if (!strcmp(file->name, filename))
             return file;
     }
 
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,116 @@
+#include "uart.h"
+#include "kernel.h"
+#include "plic.h"
+
+#ifdef CONFIG_UART_CONSOLE
+
+// Console I/O through the 16550 UART. Output is queued in tx_buf and fed to the transmit FIFO from the transmitter
+// empty interrupt; input is moved from the receive FIFO to rx_buf by the receive interrupt and wakes up the readers.
+char uart_rx_buf[UART_RX_SIZE];
+unsigned uart_rx_head, uart_rx_tail;  // Free-running read and write positions
+char uart_tx_buf[UART_TX_SIZE];
+unsigned uart_tx_head, uart_tx_tail;  // Free-running read and write positions
+
+static uint8_t uart_read(unsigned reg) {
+    return *((volatile uint8_t*)(UART_BASE + reg));
+}
+
+static void uart_write(unsigned reg, uint8_t value) {
+    *((volatile uint8_t*)(UART_BASE + reg)) = value;
+}
+
+/**
+ * Moves queued output into the transmit FIFO while it has room, and asks for an interrupt when the FIFO drains if
+ * output is left over.
+ */
+void uart_tx_start(void) {
+    if (uart_read(UART_LSR) & UART_LSR_THRE) {
+        // The FIFO is empty: it takes UART_FIFO_SIZE characters
+        for (int i = 0; i < UART_FIFO_SIZE && uart_tx_head != uart_tx_tail; i++) {
+            uart_write(UART_THR, uart_tx_buf[uart_tx_head % UART_TX_SIZE]);
+            uart_tx_head++;
+        }
+    }
+
+    const uint8_t ier = uart_read(UART_IER);
+    if (uart_tx_head != uart_tx_tail)
+        uart_write(UART_IER, ier | UART_IER_THRI);
+    else if (ier & UART_IER_THRI)
+        uart_write(UART_IER, ier & ~UART_IER_THRI);
+}
+
+/**
+ * Handles the UART interrupt: drains the receive FIFO into the input buffer and refills the transmit FIFO.
+ */
+static void uart_irq(__attribute__((unused)) void* arg) {
+    bool input = false;
+    while (uart_read(UART_LSR) & UART_LSR_DR) {
+        const char ch = uart_read(UART_RBR);
+        if (uart_rx_tail - uart_rx_head < UART_RX_SIZE) {
+            uart_rx_buf[uart_rx_tail % UART_RX_SIZE] = ch;
+            uart_rx_tail++;
+        }  // Otherwise the input buffer is full and the character is dropped
+        input = true;
+    }
+
+    uart_tx_start();
+    if (input)
+        wake_up(&console_wq);
+}
+
+/**
+ * Configures the UART for 8N1 with FIFOs and enables its receive interrupt.
+ */
+void uart_init(void) {
+    uart_write(UART_IER, 0);
+    uart_write(UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR);
+    uart_write(UART_LCR, UART_LCR_8N1);
+    uart_write(UART_MCR, UART_MCR_OUT2);
+    uart_write(UART_IER, UART_IER_RDI);
+    plic_enable(UART_IRQ, uart_irq, NULL);
+    printf("uart: console on 16550 at %x, irq %d\n", UART_BASE, UART_IRQ);
+}
+
+/**
+ * Queues a character for the transmitter. When the queue is full the caller waits for the FIFO to drain.
+ *
+ * @param ch The character to write.
+ */
+void uart_putchar(char ch) {
+    while (uart_tx_tail - uart_tx_head == UART_TX_SIZE)
+        uart_tx_start();
+
+    uart_tx_buf[uart_tx_tail % UART_TX_SIZE] = ch;
+    uart_tx_tail++;
+    if (ch == '\n' || uart_tx_tail - uart_tx_head >= UART_FIFO_SIZE)
+        uart_tx_start();
+}
+
+/**
+ * Writes a character without interrupts, after the queued output: the PANIC path.
+ *
+ * @param ch The character to write.
+ */
+void uart_putchar_sync(char ch) {
+    while (uart_tx_head != uart_tx_tail)
+        uart_tx_start();
+    while (!(uart_read(UART_LSR) & UART_LSR_THRE))
+        ;
+    uart_write(UART_THR, ch);
+}
+
+/**
+ * Reads a received character.
+ *
+ * @return The character, or -1 if there is no pending input.
+ */
+long uart_getchar(void) {
+    if (uart_rx_head == uart_rx_tail)
+        return -1;
+
+    const char ch = uart_rx_buf[uart_rx_head % UART_RX_SIZE];
+    uart_rx_head++;
+    return (unsigned char)ch;
+}
+
+#endif
@@ -0,0 +1,189 @@
+#include "kernel.h"
+
+#ifdef CONFIG_VECTOR
+
+// The kernel is built without the vector extension, so the compiler never emits vector instructions on its own; the
+// vector code is inline assembly enabling it locally, and only runs once vector_init() has found the unit.
+// The vector CSRs are accessed by number (READ_CSR stringifies its argument): vstart 0x008, vcsr 0x00f, vl 0xc20,
+// vtype 0xc21 and vlenb 0xc22.
+#define VECTOR_CSRS_SIZE 16  // vl, vtype, vstart and vcsr, saved before the registers
+
+// vlenb is the size of a vector register in bytes.
+uint32_t vlenb;
+// vector_owner is the process whose vector registers are live in the unit, or NULL if the kernel has clobbered them.
+struct process* vector_owner;
+
+/**
+ * Detects the vector unit: sstatus.VS is read-only zero on harts without it. The unit is left enabled, so that the
+ * kernel's memory and string routines can use it from now on.
+ */
+void vector_init(void) {
+    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_VS_INITIAL);
+    if (!(READ_CSR(sstatus) & SSTATUS_VS)) {
+        printf("vector: not supported, using scalar routines\n");
+        return;
+    }
+
+    vlenb = READ_CSR(0xc22);  // vlenb
+    vector_enabled = true;
+    printf("vector: VLEN=%d bits\n", vlenb * 8);
+}
+
+/**
+ * Allocates the vector save area of a new process. This is done when the process is created rather than on its first
+ * save: alloc_page() zero-fills with memset(), which uses the vector unit and would clobber the registers being saved.
+ *
+ * @return false if there is no memory for the save area.
+ */
+bool vector_alloc(struct process* proc) {
+    if (!vector_enabled)
+        return true;
+    proc->vstate = (uint8_t*)try_alloc_page(&page_list, align_up(VECTOR_CSRS_SIZE + 32 * vlenb, PAGE_SIZE) / PAGE_SIZE);
+    return proc->vstate != NULL;
+}
+
+/**
+ * Saves the vector registers of a process into its save area. Nothing may use the vector unit before the registers
+ * are stored, so this only reads CSRs and stores.
+ */
+static void vector_save(struct process* proc) {
+    uint32_t* csrs = (uint32_t*)proc->vstate;
+    csrs[0] = READ_CSR(0xc20);  // vl
+    csrs[1] = READ_CSR(0xc21);  // vtype
+    csrs[2] = READ_CSR(0x008);  // vstart
+    csrs[3] = READ_CSR(0x00f);  // vcsr
+
+    // Whole register stores do not depend on vl or vtype
+    uint8_t* regs = proc->vstate + VECTOR_CSRS_SIZE;
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "vs8r.v v0, (%0)\n"
+        "add %0, %0, %1\n"
+        "vs8r.v v8, (%0)\n"
+        "add %0, %0, %1\n"
+        "vs8r.v v16, (%0)\n"
+        "add %0, %0, %1\n"
+        "vs8r.v v24, (%0)\n"
+        ".option pop\n"
+        : "+r"(regs)
+        : "r"(8 * vlenb)
+        : "memory");
+}
+
+/**
+ * Restores the vector registers of a process saved by vector_save().
+ */
+static void vector_restore(struct process* proc) {
+    const uint32_t* csrs = (const uint32_t*)proc->vstate;
+    const uint8_t* regs = proc->vstate + VECTOR_CSRS_SIZE;
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "vl8r.v v0, (%0)\n"
+        "add %0, %0, %1\n"
+        "vl8r.v v8, (%0)\n"
+        "add %0, %0, %1\n"
+        "vl8r.v v16, (%0)\n"
+        "add %0, %0, %1\n"
+        "vl8r.v v24, (%0)\n"
+        "vsetvl zero, %2, %3\n"
+        ".option pop\n"
+        : "+r"(regs)
+        : "r"(8 * vlenb), "r"(csrs[0]), "r"(csrs[1])
+        : "memory");
+    WRITE_CSR(0x008, csrs[2]);  // vstart
+    WRITE_CSR(0x00f, csrs[3]);  // vcsr
+}
+
+/**
+ * Clears the vector registers and CSRs, for a process without saved state, so that it cannot read another process's
+ * registers or data the kernel's routines left in the unit.
+ */
+static void vector_clear(void) {
+    uint32_t vl;
+    __asm__ __volatile__(
+        ".option push\n"
+        ".option arch, +v\n"
+        "vsetvli %0, zero, e8, m8, ta, ma\n"
+        "vmv.v.i v0, 0\n"
+        "vmv.v.i v8, 0\n"
+        "vmv.v.i v16, 0\n"
+        "vmv.v.i v24, 0\n"
+        "vsetivli zero, 0, e8, m1, ta, ma\n"
+        ".option pop\n"
+        : "=r"(vl)
+        :
+        : "memory");
+    WRITE_CSR(0x008, 0);  // vstart
+    WRITE_CSR(0x00f, 0);  // vcsr
+}
+
+/**
+ * Called when a trap from user mode enters the kernel: if the process has modified its vector registers (sstatus.VS is
+ * Dirty), they are saved before the kernel may use the unit. The state is then Clean, so that the kernel's own use of
+ * the unit shows up as Dirty again.
+ */
+void vector_trap_enter(void) {
+    if (!vector_enabled || (READ_CSR(sstatus) & SSTATUS_VS) != SSTATUS_VS_DIRTY)
+        return;
+
+    vector_save(current_proc);
+    vector_owner = current_proc;
+    WRITE_CSR(sstatus, (READ_CSR(sstatus) & ~SSTATUS_VS) | SSTATUS_VS_CLEAN);
+}
+
+/**
+ * Called before returning to user mode, and by user_entry() before a new process first runs: reloads the process's
+ * vector registers if the kernel or another process has used the unit since they were saved, or clears them if the
+ * process has none.
+ */
+void vector_trap_exit(void) {
+    if (!vector_enabled)
+        return;
+
+    if ((READ_CSR(sstatus) & SSTATUS_VS) == SSTATUS_VS_DIRTY || vector_owner != current_proc) {
+        if (current_proc->vstate)
+            vector_restore(current_proc);
+        else
+            vector_clear();
+        vector_owner = current_proc;
+    }
+    WRITE_CSR(sstatus, (READ_CSR(sstatus) & ~SSTATUS_VS) | SSTATUS_VS_CLEAN);
+}
+
+/**
+ * Called before switching processes: if the kernel has used the unit, the registers belong to nobody any more.
+ */
+void vector_switch(void) {
+    if (vector_enabled && (READ_CSR(sstatus) & SSTATUS_VS) == SSTATUS_VS_DIRTY) {
+        vector_owner = NULL;
+        WRITE_CSR(sstatus, (READ_CSR(sstatus) & ~SSTATUS_VS) | SSTATUS_VS_CLEAN);
+    }
+}
+
+/**
+ * Gives a process created by fork() the vector registers of the current process. They were saved on entry to the
+ * system call if the process had modified them.
+ *
+ * @return false if there is no memory for the save area.
+ */
+bool vector_fork(struct process* child) {
+    if (!vector_alloc(child))
+        return false;
+    if (child->vstate)
+        memcpy(child->vstate, current_proc->vstate, VECTOR_CSRS_SIZE + 32 * vlenb);
+    return true;
+}
+
+/**
+ * Frees the vector save area of an exited process.
+ */
+void vector_free(struct process* proc) {
+    if (vector_owner == proc)
+        vector_owner = NULL;
+    if (proc->vstate)
+        free_page(&page_list, (paddr_t)proc->vstate, align_up(VECTOR_CSRS_SIZE + 32 * vlenb, PAGE_SIZE) / PAGE_SIZE);
+}
+
+#endif
@@ -1,34 +1,38 @@
 #include "virtio.h"
 #include "kernel.h"
+#include "plic.h"
 
 /**
  * Reads a 32-bit value from a VirtIO device register at the specified offset.
  *
+ * @param dev The device.
  * @param offset The offset of the register to read.
  * @return The value read from the register.
  */
-uint32_t virtio_reg_read32(unsigned offset) {
-    return *((volatile uint32_t*)(VIRTIO_BLK_PADDR + offset));
+uint32_t virtio_reg_read32(struct virtio_dev* dev, unsigned offset) {
+    return *((volatile uint32_t*)(dev->base + offset));
 }
 
 /**
  * Reads a 64-bit value from the specified offset in the VirtIO device's registers.
  *
+ * @param dev The device.
  * @param offset The offset in bytes from the base address of the VirtIO device's registers.
  * @return The 64-bit value read from the specified offset.
  */
-uint64_t virtio_reg_read64(unsigned offset) {
-    return *((volatile uint64_t*)(VIRTIO_BLK_PADDR + offset));
+uint64_t virtio_reg_read64(struct virtio_dev* dev, unsigned offset) {
+    return *((volatile uint64_t*)(dev->base + offset));
 }
 
 /**
- * Writes a 32-bit value to a register in the VirtIO block device.
+ * Writes a 32-bit value to a register of a VirtIO device.
  *
+ * @param dev The device.
  * @param offset The offset of the register to write to.
  * @param value The value to write to the register.
  */
-void virtio_reg_write32(unsigned offset, uint32_t value) {
-    *((volatile uint32_t*)(VIRTIO_BLK_PADDR + offset)) = value;
+void virtio_reg_write32(struct virtio_dev* dev, unsigned offset, uint32_t value) {
+    *((volatile uint32_t*)(dev->base + offset)) = value;
 }
 
 /**
@@ -36,143 +40,545 @@ void virtio_reg_write32(unsigned offset, uint32_t value) {
  * ORs it with the given value, and writes the result back to the same offset. This is
  * used to set feature bits in the device's configuration space.
  *
+ * @param dev The device.
  * @param offset The offset of the 32-bit value to fetch, OR, and write back.
  * @param value The value to OR with the fetched 32-bit value.
  */
-void virtio_reg_fetch_and_or32(unsigned offset, uint32_t value) {
-    virtio_reg_write32(offset, virtio_reg_read32(offset) | value);
+void virtio_reg_fetch_and_or32(struct virtio_dev* dev, unsigned offset, uint32_t value) {
+    virtio_reg_write32(dev, offset, virtio_reg_read32(dev, offset) | value);
 }
 
-// blk_request_vq is a pointer to the virtio_virtq struct, which represents the virtual queue used for block requests.
-struct virtio_virtq* blk_request_vq;
-// blk_req is a pointer to the virtio_blk_req struct, which represents a block request.
-struct virtio_blk_req* blk_req;
-// blk_req_paddr is the physical address of the block request.
-paddr_t blk_req_paddr;
-// blk_capacity is an unsigned integer representing the capacity of the block device.
-unsigned blk_capacity;
+// blk_devs holds the virtio-blk devices in slot order; the first one holds the file system.
+struct virtio_blk blk_devs[VIRTIO_BLK_MAX];
+// blk_count is the number of virtio-blk devices found.
+int blk_count;
 
-void virtio_blk_init(void) {
-    if (virtio_reg_read32(VIRTIO_REG_MAGIC) != 0x74726976)
-        PANIC("virtio: invalid magic value");
-    if (virtio_reg_read32(VIRTIO_REG_VERSION) != 1)
-        PANIC("virtio: invalid version");
-    if (virtio_reg_read32(VIRTIO_REG_DEVICE_ID) != VIRTIO_DEVICE_BLK)
-        PANIC("virtio: invalid device id");
+/**
+ * Scans the virtio-mmio slots of the QEMU virt machine and initializes every device the kernel has a driver for:
+ * up to VIRTIO_BLK_MAX block devices and one console. Each slot has its own register base and interrupt source.
+ */
+void virtio_init(void) {
+    for (int slot = 0; slot < VIRTIO_MMIO_SLOTS; slot++) {
+        struct virtio_dev dev = {.base = VIRTIO_MMIO_BASE + slot * VIRTIO_MMIO_STRIDE, .irq = VIRTIO0_IRQ + slot};
+        if (virtio_reg_read32(&dev, VIRTIO_REG_MAGIC) != VIRTIO_MAGIC) {
+            printf("virtio: slot %d: invalid magic value\n", slot);
+            continue;
+        }
+
+        dev.version = virtio_reg_read32(&dev, VIRTIO_REG_VERSION);
+        if (dev.version != 1 && dev.version != 2) {
+            printf("virtio: slot %d: invalid version %d\n", slot, dev.version);
+            continue;
+        }
+
+        const uint32_t device_id = virtio_reg_read32(&dev, VIRTIO_REG_DEVICE_ID);
+        switch (device_id) {
+            case 0:
+                break;  // Empty slot
+            case VIRTIO_DEVICE_BLK:
+                if (blk_count == VIRTIO_BLK_MAX) {
+                    printf("virtio: slot %d: too many block devices\n", slot);
+                    break;
+                }
+                printf("virtio: slot %d: virtio-blk%d\n", slot, blk_count);
+                virtio_blk_init(&blk_devs[blk_count++], &dev);
+                break;
+            case VIRTIO_DEVICE_CONSOLE:
+                printf("virtio: slot %d: virtio-console\n", slot);
+                virtio_console_init(&dev);
+                break;
+            default:
+                printf("virtio: slot %d: ignoring device id %d\n", slot, device_id);
+        }
+    }
+
+    if (!blk_count)
+        PANIC("virtio: no block device");
+}
 
+/**
+ * Resets a device and negotiates its features: steps 1 to 6 of the device initialization. The driver then sets up its
+ * queues and calls virtio_dev_ready().
+ *
+ * @param dev The device.
+ * @param driver_features The feature bits (first word) the driver understands.
+ */
+void virtio_dev_negotiate(struct virtio_dev* dev, uint32_t driver_features) {
     // 1. Reset the device.
-    virtio_reg_write32(VIRTIO_REG_DEVICE_STATUS, 0);
+    virtio_reg_write32(dev, VIRTIO_REG_DEVICE_STATUS, 0);
     // 2. Set the ACKNOWLEDGE status bit: the guest OS has noticed the device.
-    virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
+    virtio_reg_fetch_and_or32(dev, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
     // 3. Set the DRIVER status bit.
-    virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER);
+    virtio_reg_fetch_and_or32(dev, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER);
+    // 4. Read the device feature bits, and write the subset understood by the driver to the device.
+    virtio_reg_write32(dev, VIRTIO_REG_DEVICE_FEATURES_SEL, 0);
+    dev->features = virtio_reg_read32(dev, VIRTIO_REG_DEVICE_FEATURES) & driver_features;
+    virtio_reg_write32(dev, VIRTIO_REG_DRIVER_FEATURES_SEL, 0);
+    virtio_reg_write32(dev, VIRTIO_REG_DRIVER_FEATURES, dev->features);
+    if (dev->version == 2) {
+        // A modern device only works with drivers that accept VIRTIO_F_VERSION_1.
+        virtio_reg_write32(dev, VIRTIO_REG_DEVICE_FEATURES_SEL, 1);
+        if (!(virtio_reg_read32(dev, VIRTIO_REG_DEVICE_FEATURES) & VIRTIO_F_VERSION_1))
+            PANIC("virtio: modern device without VIRTIO_F_VERSION_1");
+        virtio_reg_write32(dev, VIRTIO_REG_DRIVER_FEATURES_SEL, 1);
+        virtio_reg_write32(dev, VIRTIO_REG_DRIVER_FEATURES, VIRTIO_F_VERSION_1);
+    }
     // 5. Set the FEATURES_OK status bit.
-    virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FEAT_OK);
+    virtio_reg_fetch_and_or32(dev, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FEAT_OK);
+    // 6. Re-read device status to ensure the FEATURES_OK bit is still set.
+    if (!(virtio_reg_read32(dev, VIRTIO_REG_DEVICE_STATUS) & VIRTIO_STATUS_FEAT_OK))
+        PANIC("virtio: feature negotiation failed");
+}
+
+/**
+ * Sets the DRIVER_OK status bit (step 8 of the device initialization): the device is live from now on.
+ *
+ * @param dev The device.
+ */
+void virtio_dev_ready(struct virtio_dev* dev) {
+    virtio_reg_fetch_and_or32(dev, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER_OK);
+}
+
+/**
+ * Initializes a virtio-blk device: negotiates its features, sets up its request queue and registers its interrupt.
+ *
+ * @param blk The driver state of the device.
+ * @param dev The device found by virtio_init().
+ */
+void virtio_blk_init(struct virtio_blk* blk, const struct virtio_dev* dev) {
+    blk->dev = *dev;
+    virtio_dev_negotiate(&blk->dev, VIRTIO_BLK_DRIVER_FEATURES);
     // 7. Perform device-specific setup, including discovery of virtqueues for the device
-    blk_request_vq = virtq_init(0);
+    blk->vq = virtq_init(&blk->dev, 0);
     // 8. Set the DRIVER_OK status bit.
-    virtio_reg_write32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER_OK);
+    virtio_dev_ready(&blk->dev);
 
     // Get capacity
-    blk_capacity = virtio_reg_read64(VIRTIO_REG_DEVICE_CONFIG + 0) * SECTOR_SIZE;
-    printf("virtio-blk: capacity is %d bytes\n", blk_capacity);
+    const uint32_t features = blk->dev.features;
+    blk->capacity = virtio_reg_read64(&blk->dev, VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CFG_CAPACITY) * SECTOR_SIZE;
+    printf("virtio-blk: capacity is %d bytes\n", blk->capacity);
 
-    // Allocate a page for blk_req
-    blk_req_paddr = alloc_page(&page_list, align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-    blk_req = (struct virtio_blk_req*)blk_req_paddr;
+    // Segment limits: with indirect descriptors a request takes one ring slot and its segments live in its own table
+    const bool indirect = features & VIRTIO_RING_F_INDIRECT_DESC;
+    blk->max_segs = VIRTIO_BLK_SEGS_MAX;
+    if (!indirect && blk->vq->num - 2 < blk->max_segs)
+        blk->max_segs = blk->vq->num - 2;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        const uint32_t seg_max = virtio_reg_read32(&blk->dev, VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < blk->max_segs)
+            blk->max_segs = seg_max;
+    }
+    // The preferred block size is honored up to a page (a block cache block); anything else falls back to sectors
+    blk->blk_size = SECTOR_SIZE;
+    if (features & VIRTIO_BLK_F_BLK_SIZE) {
+        const uint32_t blk_size = virtio_reg_read32(&blk->dev, VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CFG_BLK_SIZE);
+        if (blk_size > SECTOR_SIZE && blk_size <= PAGE_SIZE && (blk_size & (blk_size - 1)) == 0)
+            blk->blk_size = blk_size;
+    }
+    // Split segments on block boundaries, so that a large request does not end with a partial block
+    blk->size_max = 0xffffffff;
+    if (features & VIRTIO_BLK_F_SIZE_MAX)
+        blk->size_max = virtio_reg_read32(&blk->dev, VIRTIO_REG_DEVICE_CONFIG + VIRTIO_BLK_CFG_SIZE_MAX);
+    blk->size_max = align_down(blk->size_max, blk->blk_size);
+    if (!blk->size_max)
+        blk->size_max = blk->blk_size;
+    printf("virtio-blk: version %d, queue size %d, features=%x, %d segments/request, block size %d%s\n", blk->dev.version,
+           blk->vq->num, features, blk->max_segs, blk->blk_size, (features & VIRTIO_BLK_F_FLUSH) ? ", flush" : "");
+
+    // Allocate a request slot (and an indirect table) for every descriptor that can head a chain
+    const unsigned num = blk->vq->num;
+    blk->reqs_paddr = alloc_page(&page_list, align_up(sizeof(*blk->reqs) * num, PAGE_SIZE) / PAGE_SIZE);
+    blk->reqs = (struct virtio_blk_req*)blk->reqs_paddr;
+    blk->done = (bool*)alloc_page(&page_list, align_up(sizeof(bool) * num, PAGE_SIZE) / PAGE_SIZE);
+    if (indirect) {
+        const size_t size = sizeof(struct virtq_desc) * VIRTIO_BLK_INDIRECT_NUM * num;
+        blk->indirect = (struct virtq_desc*)alloc_page(&page_list, align_up(size, PAGE_SIZE) / PAGE_SIZE);
+    }
+
+    // Completions are signalled through the PLIC
+    plic_enable(blk->dev.irq, virtio_blk_irq, blk);
 }
 
-struct virtio_virtq* virtq_init(unsigned index) {
-    const paddr_t virtq_paddr = alloc_page(&page_list, align_up(sizeof(struct virtio_virtq), PAGE_SIZE) / PAGE_SIZE);
-    struct virtio_virtq* vq = (struct virtio_virtq*)virtq_paddr;
-    vq->queue_index = index;
-    vq->used_index = (volatile uint16_t*)&vq->used.index;
+/**
+ * Sets up a split virtqueue as large as the device allows (up to VIRTQ_NUM_MAX entries) and hands it to the device,
+ * through QueuePFN on legacy devices or through the separate area addresses and QueueReady on modern ones.
+ *
+ * @param dev The device.
+ * @param index The index of the queue.
+ * @return The queue.
+ */
+struct virtio_virtq* virtq_init(struct virtio_dev* dev, unsigned index) {
     // 1. Select the queue writing its index (first queue is 0) to QueueSel.
-    virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
+    virtio_reg_write32(dev, VIRTIO_REG_QUEUE_SEL, index);
+    // 2. Check if the queue is not already in use.
+    if (dev->version == 2 && virtio_reg_read32(dev, VIRTIO_REG_QUEUE_READY))
+        PANIC("virtio: queue %d is already in use", index);
+    // 3. Read maximum queue size from QueueNumMax. If the returned value is zero the queue is not available.
+    const uint32_t num_max = virtio_reg_read32(dev, VIRTIO_REG_QUEUE_NUM_MAX);
+    if (!num_max)
+        PANIC("virtio: queue %d is not available", index);
+    unsigned num = VIRTQ_NUM_MAX;
+    while (num > num_max)
+        num /= 2;
+
+    // 4. Allocate and zero the queue memory: descriptors, avail ring, used ring (page aligned), then the driver's state.
+    const size_t avail_off = sizeof(struct virtq_desc) * num;
+    const size_t used_off = align_up(avail_off + sizeof(struct virtq_avail) + sizeof(uint16_t) * (num + 1), PAGE_SIZE);
+    const size_t vq_off = align_up(used_off + sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * num + sizeof(uint16_t), 8);
+    const paddr_t virtq_paddr = alloc_page(&page_list, align_up(vq_off + sizeof(struct virtio_virtq), PAGE_SIZE) / PAGE_SIZE);
+    struct virtio_virtq* vq = (struct virtio_virtq*)(virtq_paddr + vq_off);
+    vq->dev = dev;
+    vq->descs = (struct virtq_desc*)virtq_paddr;
+    vq->avail = (struct virtq_avail*)(virtq_paddr + avail_off);
+    vq->used = (struct virtq_used*)(virtq_paddr + used_off);
+    vq->num = num;
+    vq->queue_index = index;
+    vq->used_index = (volatile uint16_t*)&vq->used->index;
+
+    // Chain every descriptor into the free list
+    for (unsigned i = 0; i < num; i++)
+        vq->descs[i].next = i + 1;
+    vq->free_head = 0;
+    vq->num_free = num;
+
     // 5. Notify the device about the queue size by writing the size to QueueNum.
-    virtio_reg_write32(VIRTIO_REG_QUEUE_NUM, VIRTQ_ENTRY_NUM);
-    // 6. Notify the device about the used alignment by writing its value in bytes to QueueAlign.
-    virtio_reg_write32(VIRTIO_REG_QUEUE_ALIGN, 0);
-    // 7. Write the physical number of the first page of the queue to the QueuePFN register.
-    virtio_reg_write32(VIRTIO_REG_QUEUE_PFN, virtq_paddr);
+    virtio_reg_write32(dev, VIRTIO_REG_QUEUE_NUM, num);
+    if (dev->version == 1) {
+        // 6. Notify the device about the used alignment by writing its value in bytes to QueueAlign.
+        virtio_reg_write32(dev, VIRTIO_REG_GUEST_PAGE_SIZE, PAGE_SIZE);
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_ALIGN, PAGE_SIZE);
+        // 7. Write the physical number of the first page of the queue to the QueuePFN register.
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_PFN, virtq_paddr / PAGE_SIZE);
+    } else {
+        // 6. Write the physical addresses of the Descriptor, Driver and Device Areas.
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_DESC_LOW, (paddr_t)vq->descs);
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_DESC_HIGH, 0);
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_DRIVER_LOW, (paddr_t)vq->avail);
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_DRIVER_HIGH, 0);
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_DEVICE_LOW, (paddr_t)vq->used);
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_DEVICE_HIGH, 0);
+        // 7. Write 0x1 to QueueReady.
+        virtio_reg_write32(dev, VIRTIO_REG_QUEUE_READY, 1);
+    }
     return vq;
 }
 
+/**
+ * Takes a descriptor from the free list of the queue.
+ *
+ * @param vq Pointer to the virtio_virtq struct representing the queue.
+ * @return The descriptor index, or -1 if every descriptor is in use.
+ */
+int virtq_alloc_desc(struct virtio_virtq* vq) {
+    if (!vq->num_free)
+        return -1;
+
+    const int index = vq->free_head;
+    vq->free_head = vq->descs[index].next;
+    vq->num_free--;
+    return index;
+}
+
+/**
+ * Returns every descriptor of a chain to the free list of the queue.
+ *
+ * @param vq Pointer to the virtio_virtq struct representing the queue.
+ * @param head The first descriptor of the chain.
+ */
+void virtq_free_chain(struct virtio_virtq* vq, int head) {
+    int index = head;
+    while (1) {
+        const uint16_t flags = vq->descs[index].flags;
+        const uint16_t next = vq->descs[index].next;
+        vq->descs[index].next = vq->free_head;
+        vq->free_head = index;
+        vq->num_free++;
+        if (!(flags & VIRTQ_DESC_F_NEXT))
+            break;
+        index = next;
+    }
+}
+
+/**
+ * @brief Makes a descriptor chain available to the device without notifying it, so that several requests can be
+ * submitted with a single virtq_notify().
+ *
+ * @param vq Pointer to the virtio_virtq struct representing the queue.
+ * @param desc_index The index of the first descriptor of the chain.
+ */
+void virtq_push(struct virtio_virtq* vq, int desc_index) {
+    vq->avail->ring[vq->avail->index % vq->num] = desc_index;
+    __sync_synchronize();
+    vq->avail->index++;
+}
+
 /**
  * @brief Notifies the device that there are new requests available in the queue.
  *
  * @param vq Pointer to the virtio_virtq struct representing the queue.
- * @param desc_index The index of the descriptor that is now available.
  */
-void virtq_kick(struct virtio_virtq* vq, int desc_index) {
-    vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
-    vq->avail.index++;
+void virtq_notify(struct virtio_virtq* vq) {
     __sync_synchronize();
-    virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-    vq->last_used_index++;
+    virtio_reg_write32(vq->dev, VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
 }
 
 /**
- * Determines if a virtqueue is busy by comparing its last used index with its used index.
+ * Drains the used ring of a block device, marking every returned request as done by its head descriptor id.
  *
- * @param vq The virtqueue to check.
- * @return True if the virtqueue is busy, false otherwise.
+ * @param blk The block device.
  */
-bool virtq_is_busy(const struct virtio_virtq* vq) {
-    return vq->last_used_index != *vq->used_index;
+static void virtio_blk_drain(struct virtio_blk* blk) {
+    struct virtio_virtq* vq = blk->vq;
+    while (vq->last_used_index != *vq->used_index) {
+        __sync_synchronize();
+        const uint32_t id = vq->used->ring[vq->last_used_index % vq->num].id;
+        if (id < vq->num)
+            blk->done[id] = true;
+        vq->last_used_index++;
+    }
 }
+
+/**
+ * Waits for a block device to make progress. Processes sleep until the completion interrupt wakes them up; during boot
+ * there is nothing else to run, so the kernel polls the used ring instead.
+ *
+ * @param blk The block device.
+ */
+static void virtio_blk_wait_event(struct virtio_blk* blk) {
+    if (can_sleep())
+        sleep_on(&blk->wq);
+    else
+        virtio_blk_drain(blk);
+}
+
+/**
+ * Returns the number of ring descriptors a request with the given number of data segments takes.
+ */
+static int virtio_blk_descs_needed(struct virtio_blk* blk, int iovcnt) {
+    return blk->indirect ? 1 : iovcnt + 2;
+}
+
+/**
+ * Queues a request on a block device without notifying it. The descriptor chain points directly at the caller's
+ * buffers: one descriptor for the header, one per segment and one for the status. With indirect descriptors the chain
+ * is built in the request's own table and takes a single ring slot. The caller sleeps until enough descriptors are free.
+ *
+ * @param blk The block device.
+ * @param type The request type (VIRTIO_BLK_T_*).
+ * @param iov The segments to read into or write from, in kernel (identity mapped) memory.
+ * @param iovcnt The number of segments, at most blk->max_segs.
+ * @param sector The first sector number to read/write.
+ * @return The request id to pass to virtio_blk_complete().
+ */
+static int virtio_blk_submit_req(struct virtio_blk* blk, uint32_t type, const struct blk_iovec* iov, int iovcnt, unsigned sector) {
+    if (iovcnt < 0 || iovcnt > (int)blk->max_segs)
+        PANIC("virtio: invalid segment count %d", iovcnt);
+
+    struct virtio_virtq* vq = blk->vq;
+    while (vq->num_free < virtio_blk_descs_needed(blk, iovcnt))
+        virtio_blk_wait_event(blk);
+
+    // Set the sector number and type of operation in the request slot of the head descriptor.
+    const int head = virtq_alloc_desc(vq);
+    struct virtio_blk_req* req = &blk->reqs[head];
+    const paddr_t req_paddr = blk->reqs_paddr + head * sizeof(*req);
+    req->type = type;
+    req->reserved = 0;
+    req->sector = sector;
+    req->status = 0xff;
+
+    // Set up the descriptors, either in the ring or in the indirect table of the request.
+    struct virtq_desc* descs = blk->indirect ? &blk->indirect[head * VIRTIO_BLK_INDIRECT_NUM] : vq->descs;
+    int cur = blk->indirect ? 0 : head;
+    descs[cur].addr = req_paddr;
+    descs[cur].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+    descs[cur].flags = VIRTQ_DESC_F_NEXT;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const int d = blk->indirect ? cur + 1 : virtq_alloc_desc(vq);
+        descs[cur].next = d;
+        descs[d].addr = (paddr_t)iov[i].buf;
+        descs[d].len = iov[i].len;
+        descs[d].flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+        cur = d;
+    }
+
+    const int status = blk->indirect ? cur + 1 : virtq_alloc_desc(vq);
+    descs[cur].next = status;
+    descs[status].addr = req_paddr + offsetof(struct virtio_blk_req, status);
+    descs[status].len = sizeof(uint8_t);
+    descs[status].flags = VIRTQ_DESC_F_WRITE;
+    descs[status].next = 0;
+
+    if (blk->indirect) {
+        vq->descs[head].addr = (paddr_t)descs;
+        vq->descs[head].len = (status + 1) * sizeof(struct virtq_desc);
+        vq->descs[head].flags = VIRTQ_DESC_F_INDIRECT;
+    }
+
+    blk->done[head] = false;
+    virtq_push(vq, head);
+    return head;
+}
+
+/**
+ * Queues a read or write of consecutive sectors on a block device without notifying it.
+ *
+ * @param blk The block device.
+ * @param iov The segments to read into or write from, in kernel (identity mapped) memory.
+ * @param iovcnt The number of segments, at most blk->max_segs, each at most blk->size_max bytes.
+ * @param sector The first sector number to read/write.
+ * @param is_write Flag indicating whether to write data to the sectors (1) or read data from the sectors (0).
+ * @return The request id to pass to virtio_blk_complete().
+ */
+int virtio_blk_submitv(struct virtio_blk* blk, const struct blk_iovec* iov, int iovcnt, unsigned sector, int is_write) {
+    return virtio_blk_submit_req(blk, is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, iov, iovcnt, sector);
+}
+
+/**
+ * Waits for a submitted request to complete and releases its descriptors. Read data has been written straight into the
+ * caller's buffers by the device.
+ *
+ * @param blk The block device.
+ * @param id The request id returned by virtio_blk_submitv().
+ * @return 0 on success, -1 if the device reported an error.
+ */
+int virtio_blk_complete(struct virtio_blk* blk, int id) {
+    while (!blk->done[id])
+        virtio_blk_wait_event(blk);
+
+    int ret = 0;
+    const struct virtio_blk_req* req = &blk->reqs[id];
+    if (req->status != 0) {
+        printf("virtio: warn: failed to read/write sector=%d status=%d\n", (unsigned)req->sector, req->status);
+        ret = -1;
+    }
+
+    virtq_free_chain(blk->vq, id);
+    wake_up(&blk->wq);  // Descriptors are free again
+    return ret;
+}
+
 /**
  * @brief Reads or writes data to/from a disk sector using VirtIO block device.
  *
+ * @param blk The block device.
  * @param buf Pointer to the buffer to read/write data.
  * @param sector The sector number to read/write.
  * @param is_write Flag indicating whether to write data to the sector (1) or read data from the sector (0).
  */
-void read_write_disk(void* buf, unsigned sector, int is_write) {
-    // Check if the sector number is within the capacity of the block device.
-    if (sector >= blk_capacity / SECTOR_SIZE) {
-        printf("virtio: tried to read/write sector=%d, but capacity is %d\n", sector, blk_capacity / SECTOR_SIZE);
-        return;
+void read_write_disk(struct virtio_blk* blk, void* buf, unsigned sector, int is_write) {
+    read_write_disk_sectors(blk, buf, sector, 1, is_write);
+}
+
+/**
+ * @brief Reads or writes consecutive sectors to/from one contiguous buffer with a single request.
+ *
+ * @param blk The block device.
+ * @param buf Pointer to the buffer to read/write data (count * SECTOR_SIZE bytes).
+ * @param sector The first sector number to read/write.
+ * @param count The number of sectors.
+ * @param is_write Flag indicating whether to write data to the sectors (1) or read data from the sectors (0).
+ * @return 0 on success, -1 on failure.
+ */
+int read_write_disk_sectors(struct virtio_blk* blk, void* buf, unsigned sector, unsigned count, int is_write) {
+    const struct blk_iovec iov = {.buf = buf, .len = count * SECTOR_SIZE};
+    return read_write_disk_vec(blk, &iov, 1, sector, is_write);
+}
+
+/**
+ * @brief Reads or writes consecutive sectors to/from a list of buffers (scatter-gather). Segments are split to the
+ * device's size_max and grouped into requests of max_segs segments; all requests that fit in the queue are submitted
+ * before the device is notified once.
+ *
+ * @param blk The block device.
+ * @param iov The segments, each a multiple of SECTOR_SIZE bytes of kernel memory.
+ * @param iovcnt The number of segments.
+ * @param sector The first sector number to read/write.
+ * @param is_write Flag indicating whether to write data to the sectors (1) or read data from the sectors (0).
+ * @return 0 on success, -1 if the request is invalid or any request failed.
+ */
+int read_write_disk_vec(struct virtio_blk* blk, const struct blk_iovec* iov, int iovcnt, unsigned sector, int is_write) {
+    unsigned count = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!is_aligned(iov[i].len, SECTOR_SIZE) || !iov[i].len) {
+            printf("virtio: segment length %d is not a multiple of the sector size\n", iov[i].len);
+            return -1;
+        }
+        count += iov[i].len / SECTOR_SIZE;
     }
 
-    // Set the sector number and type of operation (read or write) in the block request.
-    blk_req->sector = sector;
-    blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-
-    // If writing to the sector, copy the data to the block request buffer.
-    if (is_write)
-        memcpy(blk_req->data, buf, SECTOR_SIZE);
-
-    // Set up the descriptors for the VirtIO queue.
-    struct virtio_virtq* vq = blk_request_vq;
-    vq->descs[0].addr = blk_req_paddr;
-    vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-    vq->descs[0].next = 1;
-
-    vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-    vq->descs[1].len = SECTOR_SIZE;
-    vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-    vq->descs[1].next = 2;
-
-    vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-    vq->descs[2].len = sizeof(uint8_t);
-    vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
-
-    // Kick the VirtIO queue to start the operation.
-    virtq_kick(vq, 0);
-
-    // Wait for the operation to complete.
-    while (virtq_is_busy(vq))
-        ;
-
-    // Check the status of the operation.
-    if (blk_req->status != 0) {
-        printf("virtio: warn: failed to read/write sector=%d status=%d\n", sector, blk_req->status);
-        return;
+    // Check if the sectors are within the capacity of the block device.
+    if (sector + count > blk->capacity / SECTOR_SIZE) {
+        printf("virtio: tried to read/write sector=%d, but capacity is %d\n", sector + count - 1, blk->capacity / SECTOR_SIZE);
+        return -1;
     }
 
-    // If reading from the sector, copy the data from the block request buffer to the output buffer.
-    if (!is_write)
-        memcpy(buf, blk_req->data, SECTOR_SIZE);
-}
\ No newline at end of file
+    int ret = 0;
+    int i = 0;       // Current segment
+    size_t off = 0;  // Offset inside the current segment
+    while (i < iovcnt) {
+        // Fill the queue, then notify the device once for the whole batch
+        int ids[VIRTIO_BLK_BATCH_MAX];
+        int n = 0;
+        do {
+            // Gather the segments of the next request, splitting those larger than size_max
+            struct blk_iovec segs[VIRTIO_BLK_SEGS_MAX];
+            int nsegs = 0;
+            size_t bytes = 0;
+            while (i < iovcnt && nsegs < (int)blk->max_segs) {
+                size_t len = iov[i].len - off;
+                if (len > blk->size_max)
+                    len = blk->size_max;
+                segs[nsegs].buf = (uint8_t*)iov[i].buf + off;
+                segs[nsegs].len = len;
+                nsegs++;
+                bytes += len;
+                off += len;
+                if (off == iov[i].len) {
+                    i++;
+                    off = 0;
+                }
+            }
+
+            ids[n++] = virtio_blk_submitv(blk, segs, nsegs, sector, is_write);
+            sector += bytes / SECTOR_SIZE;
+        } while (i < iovcnt && n < VIRTIO_BLK_BATCH_MAX && blk->vq->num_free >= virtio_blk_descs_needed(blk, blk->max_segs));
+        virtq_notify(blk->vq);
+
+        for (int j = 0; j < n; j++) {
+            if (virtio_blk_complete(blk, ids[j]) < 0)
+                ret = -1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Issues a flush request, so that every write completed before it is on stable storage when it returns. Devices that do
+ * not offer VIRTIO_BLK_F_FLUSH have no volatile write cache to flush.
+ *
+ * @param blk The block device.
+ * @return 0 on success, -1 if the device reported an error.
+ */
+int virtio_blk_flush(struct virtio_blk* blk) {
+    if (!(blk->dev.features & VIRTIO_BLK_F_FLUSH))
+        return 0;
+
+    const int id = virtio_blk_submit_req(blk, VIRTIO_BLK_T_FLUSH, NULL, 0, 0);
+    virtq_notify(blk->vq);
+    return virtio_blk_complete(blk, id);
+}
+
+/**
+ * Handles the interrupt of a virtio-blk device: acknowledges it to the device, collects the completed requests from
+ * the used ring and wakes up the processes waiting on the device.
+ *
+ * @param arg The block device.
+ */
+void virtio_blk_irq(void* arg) {
+    struct virtio_blk* blk = arg;
+    virtio_reg_write32(&blk->dev, VIRTIO_REG_INTERRUPT_ACK, virtio_reg_read32(&blk->dev, VIRTIO_REG_INTERRUPT_STATUS));
+    virtio_blk_drain(blk);
+    wake_up(&blk->wq);
+}
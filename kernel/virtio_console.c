@@ -0,0 +1,164 @@
+#include "virtio.h"
+#include "kernel.h"
+#include "plic.h"
+
+// The virtio-console: output is copied into per-descriptor buffers and handed to the device a line (or a buffer) at a
+// time, instead of one SBI call per character. Input arrives in receive buffers and is queued for getchar().
+struct virtio_console {
+    struct virtio_dev dev;
+    struct virtio_virtq* rx;
+    struct virtio_virtq* tx;
+    char* rx_bufs;                                  // One VIRTIO_CONSOLE_BUF_SIZE buffer per receive descriptor
+    char* tx_bufs;                                  // One VIRTIO_CONSOLE_BUF_SIZE buffer per transmit descriptor
+    int tx_cur;                                     // Transmit descriptor being filled, or -1
+    unsigned tx_len;                                // Bytes in the buffer of tx_cur
+    char input[VIRTIO_CONSOLE_INPUT_SIZE];          // Received characters not yet read
+    unsigned input_head;                            // Next character to read
+    unsigned input_tail;                            // Next free slot
+};
+
+// console is the virtio-console, if the machine has one (console.tx is NULL otherwise).
+static struct virtio_console console;
+
+/**
+ * Makes a receive descriptor and its buffer available to the device.
+ *
+ * @param con The console.
+ * @param desc The receive descriptor.
+ */
+static void virtio_console_post_rx(struct virtio_console* con, int desc) {
+    con->rx->descs[desc].addr = (paddr_t)&con->rx_bufs[desc * VIRTIO_CONSOLE_BUF_SIZE];
+    con->rx->descs[desc].len = VIRTIO_CONSOLE_BUF_SIZE;
+    con->rx->descs[desc].flags = VIRTQ_DESC_F_WRITE;
+    virtq_push(con->rx, desc);
+}
+
+/**
+ * Handles the virtio-console interrupt: moves the received characters into the input queue, gives the buffers back to
+ * the device and wakes up the processes waiting for input.
+ *
+ * @param arg The console.
+ */
+static void virtio_console_irq(void* arg) {
+    struct virtio_console* con = arg;
+    virtio_reg_write32(&con->dev, VIRTIO_REG_INTERRUPT_ACK, virtio_reg_read32(&con->dev, VIRTIO_REG_INTERRUPT_STATUS));
+
+    struct virtio_virtq* vq = con->rx;
+    bool posted = false;
+    while (vq->last_used_index != *vq->used_index) {
+        __sync_synchronize();
+        const struct virtq_used_elem* elem = &vq->used->ring[vq->last_used_index % vq->num];
+        const char* buf = &con->rx_bufs[elem->id * VIRTIO_CONSOLE_BUF_SIZE];
+        for (uint32_t i = 0; i < elem->len; i++) {
+            const unsigned next = (con->input_tail + 1) % VIRTIO_CONSOLE_INPUT_SIZE;
+            if (next == con->input_head)
+                break;  // Input queue full: drop the rest
+            con->input[con->input_tail] = buf[i];
+            con->input_tail = next;
+        }
+        virtio_console_post_rx(con, elem->id);
+        posted = true;
+        vq->last_used_index++;
+    }
+
+    if (posted)
+        virtq_notify(vq);
+    wake_up(&console_wq);
+}
+
+/**
+ * Initializes the virtio-console: sets up the receive and transmit queues of port 0 and registers the interrupt. Only
+ * the first console found is used.
+ *
+ * @param dev The device found by virtio_init().
+ */
+void virtio_console_init(const struct virtio_dev* dev) {
+    struct virtio_console* con = &console;
+    if (con->tx)
+        return;
+
+    con->dev = *dev;
+    virtio_dev_negotiate(&con->dev, 0);
+    con->rx = virtq_init(&con->dev, VIRTIO_CONSOLE_RX_QUEUE);
+    con->tx = virtq_init(&con->dev, VIRTIO_CONSOLE_TX_QUEUE);
+    virtio_dev_ready(&con->dev);
+
+    const size_t rx_size = VIRTIO_CONSOLE_BUF_SIZE * con->rx->num;
+    const size_t tx_size = VIRTIO_CONSOLE_BUF_SIZE * con->tx->num;
+    con->rx_bufs = (char*)alloc_page(&page_list, align_up(rx_size, PAGE_SIZE) / PAGE_SIZE);
+    con->tx_bufs = (char*)alloc_page(&page_list, align_up(tx_size, PAGE_SIZE) / PAGE_SIZE);
+    con->tx_cur = -1;
+
+    // Completed transmissions are reclaimed lazily, so they need no interrupt
+    con->tx->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    for (int i = 0; i < VIRTIO_CONSOLE_RX_BUFS && con->rx->num_free; i++)
+        virtio_console_post_rx(con, virtq_alloc_desc(con->rx));
+    virtq_notify(con->rx);
+
+    plic_enable(con->dev.irq, virtio_console_irq, con);
+}
+
+/**
+ * Hands the partially filled transmit buffer to the device.
+ */
+void virtio_console_flush(void) {
+    struct virtio_console* con = &console;
+    if (con->tx_cur < 0)
+        return;
+
+    struct virtq_desc* desc = &con->tx->descs[con->tx_cur];
+    desc->addr = (paddr_t)&con->tx_bufs[con->tx_cur * VIRTIO_CONSOLE_BUF_SIZE];
+    desc->len = con->tx_len;
+    desc->flags = 0;
+    virtq_push(con->tx, con->tx_cur);
+    virtq_notify(con->tx);
+    con->tx_cur = -1;
+}
+
+/**
+ * Writes a character to the virtio-console. Characters are buffered until a newline or a full buffer; the kernel also
+ * flushes before it waits or switches processes.
+ *
+ * @param ch The character to write.
+ * @return false if there is no virtio-console.
+ */
+bool virtio_console_putchar(char ch) {
+    struct virtio_console* con = &console;
+    if (!con->tx)
+        return false;
+
+    if (con->tx_cur < 0) {
+        // Reclaim the buffers the device has finished with; output is never lost, so wait for one if needed
+        struct virtio_virtq* vq = con->tx;
+        do {
+            while (vq->last_used_index != *vq->used_index) {
+                __sync_synchronize();
+                virtq_free_chain(vq, vq->used->ring[vq->last_used_index % vq->num].id);
+                vq->last_used_index++;
+            }
+        } while (!vq->num_free);
+
+        con->tx_cur = virtq_alloc_desc(vq);
+        con->tx_len = 0;
+    }
+
+    con->tx_bufs[con->tx_cur * VIRTIO_CONSOLE_BUF_SIZE + con->tx_len++] = ch;
+    if (ch == '\n' || con->tx_len == VIRTIO_CONSOLE_BUF_SIZE)
+        virtio_console_flush();
+    return true;
+}
+
+/**
+ * Reads a character received by the virtio-console.
+ *
+ * @return The character, or -1 if there is no pending input (or no virtio-console).
+ */
+long virtio_console_getchar(void) {
+    struct virtio_console* con = &console;
+    if (con->input_head == con->input_tail)
+        return -1;
+
+    const char ch = con->input[con->input_head];
+    con->input_head = (con->input_head + 1) % VIRTIO_CONSOLE_INPUT_SIZE;
+    return (unsigned char)ch;
+}
@@ -0,0 +1,348 @@
+#include "vm.h"
+
+// Unused struct vmas, carved from pages as needed and recycled when regions are unmapped.
+struct vma* vma_free_list;
+
+/**
+ * Allocates a region descriptor.
+ *
+ * @return The descriptor, or NULL if there is no memory for more descriptors.
+ */
+static struct vma* vma_alloc(void) {
+    if (!vma_free_list) {
+        struct vma* vmas = (struct vma*)try_alloc_page(&page_list, 1);
+        if (!vmas)
+            return NULL;
+        for (unsigned i = 0; i < PAGE_SIZE / sizeof(struct vma); i++) {
+            vmas[i].next = vma_free_list;
+            vma_free_list = &vmas[i];
+        }
+    }
+
+    struct vma* vma = vma_free_list;
+    vma_free_list = vma->next;
+    memset(vma, 0, sizeof(*vma));
+    return vma;
+}
+
+/**
+ * Finds the region of the current process containing an address.
+ *
+ * @return The region, or NULL if the address is not in a mapped region.
+ */
+static struct vma* vma_find(vaddr_t addr) {
+    for (struct vma* vma = current_proc->vmas; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the leaf page table entry mapping an address: a 4KB page, or a megapage of the kernel.
+ *
+ * @return The entry, or NULL if there is no second level table for the address.
+ */
+static uint32_t* pte_lookup(uint32_t* table1, vaddr_t va) {
+    uint32_t* pte1 = &table1[(va >> 22) & 0x3ff];
+    if (!(*pte1 & PAGE_V) || (*pte1 & (PAGE_R | PAGE_W | PAGE_X)))
+        return pte1;
+
+    uint32_t* table0 = (uint32_t*)((*pte1 >> 10) * PAGE_SIZE);
+    return &table0[(va >> 12) & 0x3ff];
+}
+
+/**
+ * Returns the page table entry of a user page, allocating the second level table if needed. Unlike map_page(), this
+ * fails instead of panicking when memory runs out, since a process can ask for more memory than there is.
+ *
+ * @return The entry, or NULL if there is no memory for the table.
+ */
+static uint32_t* pte_alloc(uint32_t* table1, vaddr_t va) {
+    uint32_t* pte1 = &table1[(va >> 22) & 0x3ff];
+    if (!(*pte1 & PAGE_V)) {
+        const paddr_t table0 = try_alloc_page(&page_list, 1);
+        if (!table0)
+            return NULL;
+        *pte1 = ((table0 / PAGE_SIZE) << 10) | PAGE_V;
+    }
+    return pte_lookup(table1, va);
+}
+
+/**
+ * Flushes the TLB entry of a user page of the current process.
+ */
+static void vm_flush_page(vaddr_t va) {
+    __asm__ __volatile__("sfence.vma %0, %1" ::"r"(va), "r"(current_proc->asid) : "memory");
+}
+
+/**
+ * Maps the program of a new process: USER_BASE to USER_END, backed by the image, then zero-filled for the bss, the stack
+ * and the rest. Like any region, its pages are only allocated when the program touches them.
+ *
+ * @param proc The new process.
+ * @param image The program image, in kernel memory.
+ * @param image_size The size of the image in bytes.
+ */
+void vm_map_image(struct process* proc, const void* image, size_t image_size) {
+    if (image_size > USER_END - USER_BASE)
+        PANIC("program image too large (%d bytes)", image_size);
+
+    struct vma* vma = vma_alloc();
+    if (!vma)
+        PANIC("out of memory");
+    vma->start = USER_BASE;
+    vma->end = USER_END;
+    vma->prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    vma->image = image;
+    vma->image_size = image_size;
+    // Regions are sorted, and the program sits below MMAP_BASE
+    vma->next = proc->vmas;
+    proc->vmas = vma;
+}
+
+/**
+ * Maps a region into the current process, at the lowest free address above MMAP_BASE. Nothing is allocated until the
+ * pages are touched.
+ *
+ * @param file The file to map from offset 0, or NULL for zero-filled memory.
+ * @param len The length of the region in bytes.
+ * @param prot PROT_READ, PROT_WRITE and PROT_EXEC.
+ * @return The address of the region, or 0 if there is no room or no memory for its descriptor.
+ */
+vaddr_t vm_mmap(struct file* file, size_t len, int prot) {
+    len = align_up(len, PAGE_SIZE);
+    if (!len || len > MMAP_END - MMAP_BASE)
+        return 0;
+
+    // First fit between the sorted regions
+    vaddr_t start = MMAP_BASE;
+    struct vma** link = &current_proc->vmas;
+    while (*link && (*link)->start < start + len) {
+        if ((*link)->end > start)
+            start = (*link)->end;
+        link = &(*link)->next;
+    }
+    if (start + len > MMAP_END)
+        return 0;
+
+    struct vma* vma = vma_alloc();
+    if (!vma)
+        return 0;
+    vma->start = start;
+    vma->end = start + len;
+    vma->prot = prot;
+    vma->file = file;
+    vma->next = *link;
+    *link = vma;
+    return start;
+}
+
+/**
+ * Unmaps a region of the current process and frees the pages it touched.
+ *
+ * @param addr The address returned by vm_mmap().
+ * @return 0 on success, or -1 if no region mapped by vm_mmap() starts at addr.
+ */
+int vm_munmap(vaddr_t addr) {
+    struct vma** link = &current_proc->vmas;
+    while (*link && (*link)->start != addr)
+        link = &(*link)->next;
+    struct vma* vma = *link;
+    // The program region below MMAP_BASE stays
+    if (!vma || vma->start < MMAP_BASE)
+        return -1;
+
+    for (vaddr_t va = vma->start; va < vma->end; va += PAGE_SIZE) {
+        uint32_t* pte = pte_lookup(current_proc->page_table, va);
+        if (*pte & PAGE_V) {
+            free_page(&page_list, (*pte >> 10) * PAGE_SIZE, 1);
+            *pte = 0;
+            vm_flush_page(va);
+        }
+    }
+
+    *link = vma->next;
+    vma->next = vma_free_list;
+    vma_free_list = vma;
+    return 0;
+}
+
+/**
+ * Gives a page shared by fork() its own copy, on the first write to it. The last process still sharing the page just
+ * makes it writable again.
+ *
+ * @param pte The entry mapping the page, PAGE_COW set.
+ * @param va The address of the page.
+ * @return false if there is no memory for the copy.
+ */
+static bool vm_copy_on_write(uint32_t* pte, vaddr_t va) {
+    const paddr_t old = (*pte >> 10) * PAGE_SIZE;
+    const uint32_t flags = (*pte & 0x3ff & ~PAGE_COW) | PAGE_W;
+    if (page_refcount(&page_list, old) == 1) {
+        *pte = (*pte & ~0x3ff) | flags;
+    } else {
+        const paddr_t page = try_alloc_page(&page_list, 1);
+        if (!page)
+            return false;
+        memcpy((void*)page, (void*)old, PAGE_SIZE);
+        free_page(&page_list, old, 1);
+        *pte = ((page / PAGE_SIZE) << 10) | flags;
+    }
+    vm_flush_page(va);
+    return true;
+}
+
+/**
+ * Handles a page fault of the current process: if the address is in a region that allows the access and the page is
+ * not mapped yet, a page is allocated, filled from the file or the program image (or with zeros) and mapped. A write to
+ * a page shared by fork() copies it.
+ *
+ * @param addr The faulting address.
+ * @param access PROT_READ, PROT_WRITE or PROT_EXEC.
+ * @return true if the access can be retried, false if it is invalid or there is no memory left for the page.
+ */
+bool vm_fault(vaddr_t addr, int access) {
+    struct vma* vma = vma_find(addr);
+    if (!vma || !(vma->prot & access))
+        return false;
+
+    const vaddr_t va = align_down(addr, PAGE_SIZE);
+    uint32_t* pte = pte_alloc(current_proc->page_table, va);
+    if (!pte)
+        return false;
+    if ((*pte & PAGE_V) && access == PROT_WRITE && (*pte & PAGE_COW))
+        return vm_copy_on_write(pte, va);
+    if (*pte & PAGE_V)
+        return false;  // Mapped, so the access itself is not permitted
+
+    const paddr_t page = try_alloc_page(&page_list, 1);
+    if (!page)
+        return false;
+    const size_t off = va - vma->start;
+    if (vma->image && off < vma->image_size)
+        memcpy((void*)page, vma->image + off, vma->image_size - off < PAGE_SIZE ? vma->image_size - off : PAGE_SIZE);
+    if (vma->file && fs_read(vma->file, vma->offset + off, (void*)page, PAGE_SIZE) < 0) {
+        free_page(&page_list, page, 1);
+        return false;
+    }
+
+    // Write permission needs read permission in Sv32
+    uint32_t flags = PAGE_U;
+    if (vma->prot & (PROT_READ | PROT_WRITE))
+        flags |= PAGE_R;
+    if (vma->prot & PROT_WRITE)
+        flags |= PAGE_W;
+    if (vma->prot & PROT_EXEC)
+        flags |= PAGE_X;
+    *pte = ((page / PAGE_SIZE) << 10) | flags | PAGE_V;
+    vm_flush_page(va);
+    return true;
+}
+
+/**
+ * Checks that the current process may access a buffer it passed to a system call, and faults its pages in. The kernel
+ * cannot take page faults itself, so it calls this before touching user memory.
+ *
+ * @param buf The buffer.
+ * @param len The length of the buffer.
+ * @param access PROT_READ if the kernel reads the buffer, PROT_WRITE if it writes it.
+ * @return true if the whole buffer is accessible.
+ */
+bool vm_access(const void* buf, size_t len, int access) {
+    const vaddr_t start = (vaddr_t)buf;
+    if (start + len < start)
+        return false;
+
+    const uint32_t need = PAGE_V | PAGE_U | (access == PROT_WRITE ? PAGE_W : PAGE_R);
+    for (vaddr_t va = align_down(start, PAGE_SIZE); va < start + len; va += PAGE_SIZE) {
+        const uint32_t* pte = pte_lookup(current_proc->page_table, va);
+        if ((*pte & need) != need && !vm_fault(va, access))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Checks that the current process may let the kernel read a NUL-terminated string, and faults its pages in.
+ *
+ * @param str The string.
+ * @return true if the whole string is readable.
+ */
+bool vm_access_string(const char* str) {
+    vaddr_t va = (vaddr_t)str;
+    while (1) {
+        const size_t len = align_down(va, PAGE_SIZE) + PAGE_SIZE - va;
+        if (!vm_access((const void*)va, len, PROT_READ))
+            return false;
+        for (size_t i = 0; i < len; i++) {
+            if (((const char*)va)[i] == '\0')
+                return true;
+        }
+        va += len;
+    }
+}
+
+/**
+ * Gives a new process a copy of the address space of the current process. The regions are copied, but the pages are
+ * shared: writable pages become read-only in both processes and are copied on the first write, so fork() costs the page
+ * tables rather than the memory.
+ *
+ * @param child The new process, with no user mappings yet.
+ * @return false if memory ran out. The pages copied so far are mapped in the child, and are shared copy-on-write until
+ *         destroy_process() drops the child's references.
+ */
+bool vm_fork(struct process* child) {
+    struct vma** link = &child->vmas;
+    for (const struct vma* vma = current_proc->vmas; vma; vma = vma->next) {
+        struct vma* copy = vma_alloc();
+        if (!copy)
+            return false;
+        *copy = *vma;
+        copy->next = NULL;
+        *link = copy;
+        link = &copy->next;
+    }
+
+    uint32_t* table1 = current_proc->page_table;
+    bool ok = true;
+    for (uint32_t vpn1 = 0; vpn1 < 1024 && ok; vpn1++) {
+        if (!(table1[vpn1] & PAGE_V) || (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X)))
+            continue;  // No second level table, or a kernel megapage (map_kernel() maps those)
+
+        uint32_t* table0 = (uint32_t*)((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (uint32_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+            uint32_t* pte = &table0[vpn0];
+            if (!(*pte & PAGE_V) || !(*pte & PAGE_U))
+                continue;
+
+            uint32_t* child_pte = pte_alloc(child->page_table, (vpn1 << 22) | (vpn0 << 12));
+            if (!child_pte) {
+                ok = false;
+                break;
+            }
+            if (*pte & PAGE_W)
+                *pte = (*pte & ~PAGE_W) | PAGE_COW;
+            ref_page(&page_list, (*pte >> 10) * PAGE_SIZE);
+            *child_pte = *pte;
+        }
+    }
+
+    // The pages that were made read-only may still be writable in the TLB
+    __asm__ __volatile__("sfence.vma zero, %0" ::"r"(current_proc->asid) : "memory");
+    return ok;
+}
+
+/**
+ * Frees the region descriptors of an exited process. Its pages are freed with its page table.
+ *
+ * @param proc The process.
+ */
+void vm_free(struct process* proc) {
+    while (proc->vmas) {
+        struct vma* vma = proc->vmas;
+        proc->vmas = vma->next;
+        vma->next = vma_free_list;
+        vma_free_list = vma;
+    }
+}
@@ -4,8 +4,23 @@ set -xue
 # QEMU path
 QEMU=qemu-system-riscv32
 
+# VIRTIO_CONSOLE=1 ./run.sh attaches a virtio-console to the terminal; the kernel then uses it instead of SBI
+if [ "${VIRTIO_CONSOLE:-0}" = 1 ]; then
+	CONSOLE="-chardev stdio,mux=on,id=con0 -serial chardev:con0 -mon chardev=con0 \
+		-device virtio-serial-device,bus=virtio-mmio-bus.1 -device virtconsole,chardev=con0"
+else
+	CONSOLE="-serial mon:stdio"
+fi
+
+# VECTOR=1 ./run.sh gives the hart the vector extension
+CPU=""
+if [ "${VECTOR:-0}" = 1 ]; then
+	CPU="-cpu rv32,v=true,vlen=128"
+fi
+
 # run QEMU
-${QEMU} -machine virt -bios default -nographic -serial mon:stdio --no-reboot \
+${QEMU} -machine virt ${CPU} -bios default -nographic ${CONSOLE} --no-reboot \
+	-global virtio-mmio.force-legacy=false \
 	-drive id=drive0,file=disk.tar,format=raw \
 	-device virtio-blk-device,drive=drive0,bus=virtio-mmio-bus.0 \
 	-kernel kernel.elf
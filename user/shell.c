@@ -27,12 +27,35 @@ void main(void) {
         } else if (strncmp(cmdline, "echo ", 4) == 0) {
             printf("%s\n", cmdline + 5);
         } else if (strncmp(cmdline, "cat ", 3) == 0) {
+            // Stream the file through a small buffer, so that files of any size can be printed
+            const int fd = open(cmdline + 4, O_RDONLY);
+            if (fd < 0) {
+                printf("cat: %s: no such file\n", cmdline + 4);
+                continue;
+            }
+
+            flush();
             char buf[128];
-            int len = readfile(cmdline + 4, buf, sizeof(buf));
-            buf[len] = '\0';
-            printf("%s\n", buf);
+            int len;
+            while ((len = read(fd, buf, sizeof(buf))) > 0)
+                write(STDOUT_FILENO, buf, len);
+            close(fd);
+            printf("\n");
         } else if (strncmp(cmdline, "write ", 5) == 0) {
             writefile(cmdline + 6, cmdline + 6, strlen(cmdline + 6));
+        } else if (strcmp(cmdline, "sync") == 0) {
+            sync();
+        } else if (strcmp(cmdline, "fork") == 0) {
+            const int pid = fork();
+            if (pid < 0) {
+                printf("fork: out of memory\n");
+                continue;
+            }
+            if (pid == 0) {
+                printf("Hello world from child!\n");
+                exit();
+            }
+            printf("forked process %d\n", pid);
         } else {
             printf("unknown command: %s\n", cmdline);
         }
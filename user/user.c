@@ -2,22 +2,49 @@
 
 extern char __stack_top[];
 
+// Standard output is line buffered: it is written with one SYS_WRITE per line instead of one trap per character.
+static char stdout_buf[128];
+static int stdout_len;
+
+/**
+ * Writes out the buffered standard output.
+ */
+void flush(void) {
+    if (stdout_len > 0)
+        write(1, stdout_buf, stdout_len);
+    stdout_len = 0;
+}
+
 void putchar(char c) {
-    syscall(SYS_PUTCHAR, c, 0, 0);
+    stdout_buf[stdout_len++] = c;
+    if (c == '\n' || stdout_len == (int)sizeof(stdout_buf))
+        flush();
 }
 
 int getchar(void) {
+    flush();  // Show the prompt before waiting for input
     return syscall(SYS_GETCHAR, 0, 0, 0);
 }
 
+/**
+ * Runs before main(): asks the kernel which optional hardware the memory and string routines may use.
+ */
+void user_init(void) {
+#ifdef CONFIG_VECTOR
+    vector_enabled = (syscall(SYS_HWCAP, 0, 0, 0) & HWCAP_V) != 0;
+#endif
+}
+
 __attribute__((section(".text.start"))) __attribute__((naked)) void start(void) {
     __asm__ __volatile__(
         "mv sp, %[stack_top]\n"
+        "call user_init\n"
         "call main\n"
         "call exit\n" ::[stack_top] "r"(__stack_top));
 }
 
 __attribute__((noreturn)) void exit(void) {
+    flush();
     syscall(SYS_EXIT, 0, 0, 0);
     for (;;)
         ;  // unreachable but just in case
@@ -48,10 +75,56 @@ int syscall(int sysno, int arg0, int arg1, int arg2) {
     return a0;
 }
 
+int write(int fd, const void* buf, int len) {
+    return syscall(SYS_WRITE, fd, (int)buf, len);
+}
+
+int open(const char* filename, int flags) {
+    return syscall(SYS_OPEN, (int)filename, flags, 0);
+}
+
+int read(int fd, void* buf, int len) {
+    return syscall(SYS_READ, fd, (int)buf, len);
+}
+
+int lseek(int fd, int offset, int whence) {
+    return syscall(SYS_LSEEK, fd, offset, whence);
+}
+
+int close(int fd) {
+    return syscall(SYS_CLOSE, fd, 0, 0);
+}
+
+void* mmap(int fd, int len, int prot) {
+    return (void*)syscall(SYS_MMAP, fd, len, prot);
+}
+
+int munmap(void* addr) {
+    return syscall(SYS_MUNMAP, (int)addr, 0, 0);
+}
+
 int readfile(const char* filename, char* buf, int len) {
     return syscall(SYS_READFILE, (int)filename, (int)buf, len);
 }
 
 int writefile(const char* filename, const char* buf, int len) {
     return syscall(SYS_WRITEFILE, (int)filename, (int)buf, len);
+}
+
+int setprio(int prio) {
+    return syscall(SYS_SETPRIO, prio, 0, 0);
+}
+
+int sync(void) {
+    return syscall(SYS_SYNC, 0, 0, 0);
+}
+
+/**
+ * Creates a copy of the calling process.
+ *
+ * @return The process ID of the child in the parent, 0 in the child, or -1 if there is not enough memory.
+ */
+int fork(void) {
+    flush();  // Otherwise both processes would print the buffered output
+    return syscall(SYS_FORK, 0, 0, 0);
 }
\ No newline at end of file